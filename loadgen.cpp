@@ -0,0 +1,121 @@
+#include <mpi.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "src/Config.h"
+#include "src/DataLoader.h"
+#include "src/DistributedLog.h"
+#include "src/QueryServer.h"
+
+/*
+ * Closed loop load generator for the query server: each client thread keeps one query in flight
+ * over its own connection and records the end to end latency of every request.
+ */
+void RunClient(int fd, SvmDataset<uint32_t>& queries, uint64_t client, uint64_t requests,
+               uint64_t label_bytes, LatencyStats& stats) {
+  std::vector<char> response;
+
+  for (uint64_t r = 0; r < requests; r++) {
+    uint64_t q = (client * requests + r) % queries.len;
+    uint32_t nnz = queries.Len(q);
+
+    auto start = std::chrono::steady_clock::now();
+    if (!WriteFully(fd, &nnz, sizeof(uint32_t)) ||
+        !WriteFully(fd, queries.Indices(q), nnz * sizeof(uint32_t)) ||
+        !WriteFully(fd, queries.Values(q), nnz * sizeof(float))) {
+      break;
+    }
+
+    uint32_t len;
+    if (!ReadFully(fd, &len, sizeof(uint32_t))) {
+      break;
+    }
+    response.resize(len * label_bytes);
+    if (!ReadFully(fd, response.data(), len * label_bytes)) {
+      break;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    stats.Record(std::chrono::duration<double, std::micro>(end - start).count());
+  }
+  close(fd);
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    std::cerr << "Invalid arguments, usage '$ ./loadgen <config file name>'" << std::endl;
+    return 1;
+  }
+
+  ConfigReader config(argv[1]);
+
+  MPI_Init(0, 0);
+  Logging::InitLogging(config.StrVal("logfile") + "_loadgen");
+
+  std::string socket_path = config.StrVal("socket_path");
+  uint64_t Q = config.IntVal("query_len");
+  uint64_t clients = config.IntVal("loadgen_clients");
+  uint64_t requests = config.IntVal("loadgen_requests");
+  uint64_t label_bytes = (config.Contains("label_bits") ? config.IntVal("label_bits") : 32) / 8;
+  uint64_t avg_dim = config.Contains("avg_dim") ? config.IntVal("avg_dim") : 0;
+
+  SvmDataset<uint32_t> queries = SvmDataset<uint32_t>::ReadSvmDataset(
+      config.StrVal("query_file"), (uint32_t)0, Q, avg_dim, 0);
+
+  // Every client connects up front, so that an unreachable server fails the run before it starts.
+  std::vector<int> fds;
+  try {
+    for (uint64_t c = 0; c < clients; c++) {
+      fds.push_back(ConnectUnixSocket(socket_path));
+    }
+  } catch (const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+    for (int fd : fds) {
+      close(fd);
+    }
+    MPI_Finalize();
+    return 1;
+  }
+
+  std::vector<LatencyStats> stats(clients);
+  std::vector<std::thread> threads;
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t c = 0; c < clients; c++) {
+    threads.emplace_back(RunClient, fds[c], std::ref(queries), c, requests, label_bytes,
+                         std::ref(stats[c]));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  LatencyStats total;
+  for (const auto& s : stats) {
+    total.Merge(s);
+  }
+  total.Log("Loadgen (" + std::to_string(clients) + " clients)",
+            std::chrono::duration<double>(end - start).count());
+
+  if (config.Contains("loadgen_shutdown") && config.IntVal("loadgen_shutdown")) {
+    uint32_t shutdown = ShutdownRequest;
+    try {
+      int fd = ConnectUnixSocket(socket_path);
+      if (!WriteFully(fd, &shutdown, sizeof(uint32_t))) {
+        std::cerr << "Unable to send the shutdown request" << std::endl;
+      }
+      close(fd);
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
+  MPI_Finalize();
+  Logging::StopLogging();
+  return 0;
+}
@@ -1,15 +1,30 @@
 #include "src/Slash.h"
 
 #include <mpi.h>
+#include <omp.h>
 
+#include <atomic>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <numeric>
 #include <random>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "src/Config.h"
 #include "src/DataLoader.h"
 #include "src/DistributedLog.h"
+#include "src/FixedConfigs.h"
+#include "src/Memory.h"
+#include "src/Quantized.h"
+#include "src/QueryServer.h"
+#include "src/ResultFile.h"
+#include "src/SRP.h"
 
 class InitHelper {
  public:
@@ -50,33 +65,55 @@ double SparseMultiply(uint32_t* iA, float* vA, uint64_t lA, uint32_t* iB, float*
   return val;
 }
 
-template <typename Label_t>
-void Eval(SvmDataset<Label_t>& data, SvmDataset<Label_t>& queries, QueryResult<Label_t>& results,
-          uint64_t K) {
+/*
+ * Mean over the queries of the average cosine similarity between a query and its top K results,
+ * where cosine(query, result) computes one similarity.
+ */
+template <typename Label_t, typename Cosine>
+double AverageCosine(const QueryResult<Label_t>& results, uint64_t K, Cosine cosine) {
   double totalSim = 0;
   uint64_t cnt = 0;
-  for (uint64_t query = 0; query < queries.len; query++) {
+  for (uint64_t query = 0; query < results.len(); query++) {
     double tmpSim = 0;
     uint64_t tmpCnt = 0;
     for (uint64_t x = 0; x < std::min(K, results.len(query)); x++) {
-      auto result = results[query][x];
-      double innerProduct =
-          SparseMultiply(queries.Indices(query), queries.Values(query), queries.Len(query),
-                         data.Indices(result), data.Values(result), data.Len(result));
-      double queryMagnitude = Magnitude(queries.Values(query), queries.Len(query));
-      double dataMagnitude = Magnitude(data.Values(result), data.Len(result));
-
-      tmpSim += innerProduct / (queryMagnitude * dataMagnitude);
+      tmpSim += cosine(query, results[query][x]);
       tmpCnt++;
     }
+    // Queries without results, possible under a selective filter, do not count.
+    if (tmpCnt == 0) {
+      continue;
+    }
     totalSim += tmpSim / tmpCnt;
     cnt++;
   }
+  return totalSim / cnt;
+}
+
+template <typename Label_t>
+double ExactCosine(SvmDataset<Label_t>& data, SvmDataset<Label_t>& queries,
+                   const QueryResult<Label_t>& results, uint64_t K) {
+  return AverageCosine(results, K, [&](uint64_t query, Label_t result) {
+    double innerProduct =
+        SparseMultiply(queries.Indices(query), queries.Values(query), queries.Len(query),
+                       data.Indices(result), data.Values(result), data.Len(result));
+    double queryMagnitude = Magnitude(queries.Values(query), queries.Len(query));
+    double dataMagnitude = Magnitude(data.Values(result), data.Len(result));
+    return innerProduct / (queryMagnitude * dataMagnitude);
+  });
+}
 
-  LOG << "Average Cosine Similarity @" << K << " = " << totalSim / cnt << std::endl;
+template <typename Label_t>
+double QuantizedCosine(const QuantizedRows& data, SvmDataset<Label_t>& queries,
+                       const std::vector<double>& query_norms, const QueryResult<Label_t>& results,
+                       uint64_t K) {
+  return AverageCosine(results, K, [&](uint64_t query, Label_t result) {
+    return data.Cosine(queries.Indices(query), queries.Values(query), queries.Len(query),
+                       query_norms[query], result);
+  });
 }
 
-std::vector<std::vector<uint32_t>> ReadGroundTruths(std::string filename, uint64_t Q,
+std::vector<std::vector<uint64_t>> ReadGroundTruths(std::string filename, uint64_t Q,
                                                     uint64_t topk) {
   std::ifstream file(filename);
   std::string line;
@@ -84,14 +121,14 @@ std::vector<std::vector<uint32_t>> ReadGroundTruths(std::string filename, uint64
   file.close();
   std::stringstream stream(line);
 
-  std::vector<std::vector<uint32_t>> data;
+  std::vector<std::vector<uint64_t>> data;
   std::string item;
 
   for (uint32_t q = 0; q < Q; q++) {
-    std::vector<uint32_t> row;
+    std::vector<uint64_t> row;
     for (uint32_t k = 0; k < topk; k++) {
       stream >> item;
-      row.push_back(atol(item.c_str()));
+      row.push_back(atoll(item.c_str()));
     }
     data.push_back(std::move(row));
   }
@@ -100,79 +137,1482 @@ std::vector<std::vector<uint32_t>> ReadGroundTruths(std::string filename, uint64
   return data;
 }
 
-int main(int argc, char** argv) {
-  if (argc != 2) {
-    std::cerr << "Invalid arguments, usage '$ ./slash <config file name>'" << std::endl;
-    return 1;
+template <typename Label_t>
+double Recall(const QueryResult<Label_t>& results,
+              const std::vector<std::vector<uint64_t>>& gtruths, uint32_t eval_k,
+              uint64_t offset = 0) {
+  double recall = 0.0;
+  for (uint32_t q = 0; q < results.len(); q++) {
+    uint32_t correct = 0;
+    uint32_t end = std::min<uint32_t>(eval_k, results.len(q));
+    for (uint32_t i = 0; i < end; i++) {
+      for (uint32_t j = 0; j < 100; j++) {
+        if (results[q][i] == gtruths.at(offset + q).at(j)) {
+          correct++;
+        }
+      }
+    }
+    if (end > 0) {
+      recall += ((double)correct) / end;
+    }
   }
+  return recall / results.len();
+}
 
-  ConfigReader config(argv[1]);
+// Throws std::runtime_error naming the invariant if it does not hold.
+void Check(bool holds, const std::string& invariant) {
+  if (!holds) {
+    throw std::runtime_error("Invariant violated: " + invariant);
+  }
+}
 
-  InitHelper _i_(config.StrVal("logfile"));
+/*
+ * The data_len rows of data_file after the first query_len, and the query_len rows of query_file,
+ * that the single machine benchmarks run on. Ground truths are only read when asked for, since
+ * not every benchmark measures recall.
+ */
+struct BenchmarkInputs {
+  BenchmarkInputs(const ConfigReader& config, bool read_gtruths)
+      : N(config.IntVal("data_len")),
+        Q(config.IntVal("query_len")),
+        topk(config.IntVal("topk")),
+        avg_dim(config.Contains("avg_dim") ? config.IntVal("avg_dim") : 0),
+        data(SvmDataset<uint32_t>::ReadSvmDataset(config.StrVal("data_file"), (uint32_t)0, N,
+                                                  avg_dim, Q)),
+        queries(SvmDataset<uint32_t>::ReadSvmDataset(config.StrVal("query_file"), (uint32_t)0, Q,
+                                                     avg_dim, 0)) {
+    if (read_gtruths) {
+      gtruths = ReadGroundTruths(config.StrVal("gtruths"), Q, config.IntVal("gtruth_topk"));
+    }
+  }
 
-  config.PrintConfigVals();
+  uint64_t N, Q, topk, avg_dim;
+  SvmDataset<uint32_t> data, queries;
+  std::vector<std::vector<uint64_t>> gtruths;
+};
+
+template <typename Label_t>
+void Serve(const ConfigReader& config, Slash<Label_t>& slash) {
+  int rank, world_size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+  // Each rank serves queries against its own shard of the index.
+  std::string socket_path = config.StrVal("socket_path");
+  if (world_size > 1) {
+    socket_path.append(std::to_string(rank));
+  }
+
+  uint64_t deadline_us =
+      config.Contains("server_deadline_us") ? config.IntVal("server_deadline_us") : 0;
+  uint64_t max_nnz =
+      config.Contains("server_max_nnz") ? config.IntVal("server_max_nnz") : DefaultMaxRequestNnz;
+  QueryServer<Label_t> server(slash, socket_path, config.IntVal("server_max_batch"),
+                              config.IntVal("server_max_wait_us"), config.IntVal("topk"),
+                              deadline_us, max_nnz);
+  server.Run();
+  if (slash.Cache() != nullptr) {
+    slash.Cache()->Log("Query cache");
+  }
+}
+
+/*
+ * Queries a concurrent index while a second thread inserts the back half of the data at full
+ * rate, and compares query latency against an idle index. Every returned label is checked to be
+ * a label that the ingest could have published.
+ */
+void ConcurrentBenchmark(const ConfigReader& config) {
+  BenchmarkInputs inputs(config, false);
+  uint64_t N = inputs.N, Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+  uint64_t batch_size = config.IntVal("batch_size");
+  uint64_t query_batch = config.IntVal("bench_query_batch");
+
+  Slash<uint32_t> slash(config.IntVal("K"), config.IntVal("L"), config.IntVal("range_pow"),
+                        config.IntVal("reservoir_size"), true);
+
+  uint64_t half = N / 2;
+  CsrView front{half, data.indices, data.values, data.markers};
+  CsrView back{N - half, data.indices, data.values, data.markers + half};
+  slash.InsertSVM(front, (uint32_t)0, batch_size);
+
+  QueryResult<uint32_t> results;
+  uint64_t invalid = 0;
+  auto query_batch_at = [&](uint64_t b) {
+    uint64_t offset = (b * query_batch) % Q;
+    uint64_t cnt = std::min(query_batch, Q - offset);
+    CsrView batch{cnt, queries.indices, queries.values, queries.markers + offset};
+
+    auto start = std::chrono::steady_clock::now();
+    slash.QuerySVMSingleMachine(batch, topk, results);
+    auto end = std::chrono::steady_clock::now();
+
+    for (uint64_t q = 0; q < cnt; q++) {
+      for (uint64_t i = 0; i < results.len(q); i++) {
+        invalid += results[q][i] >= N;
+      }
+    }
+    return std::chrono::duration<double, std::micro>(end - start).count();
+  };
+
+  uint64_t rounds = (Q + query_batch - 1) / query_batch;
+  LatencyStats idle;
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t b = 0; b < rounds; b++) {
+    idle.Record(query_batch_at(b));
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  idle.Log("Idle index", elapsed, "batches of " + std::to_string(query_batch));
+
+  std::atomic<bool> ingesting(true);
+  std::thread ingest([&] {
+    slash.InsertSVM(back, (uint32_t)half, batch_size);
+    ingesting = false;
+  });
 
+  LatencyStats busy;
+  start = std::chrono::steady_clock::now();
+  for (uint64_t b = 0; ingesting; b++) {
+    busy.Record(query_batch_at(b));
+  }
+  ingest.join();
+  elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  busy.Log("Ingesting index", elapsed, "batches of " + std::to_string(query_batch));
+  LOG << "Ingested " << N - half << " vectors at " << (N - half) / elapsed
+      << " vectors/sec while querying, invalid labels observed = " << invalid << std::endl;
+}
+
+/*
+ * Measures the cost of the tombstone check on query throughput. Queries are timed on the full
+ * index, after delete_fraction of the labels are tombstoned, and after compacting buckets with
+ * at least compact_fraction dead slots. A slice of the deleted labels is then updated to the
+ * query vectors, which should bring them back as their own nearest neighbours.
+ */
+void DeleteBenchmark(const ConfigReader& config) {
+  BenchmarkInputs inputs(config, false);
+  uint64_t N = inputs.N, Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+
+  Slash<uint32_t> slash(config.IntVal("K"), config.IntVal("L"), config.IntVal("range_pow"),
+                        config.IntVal("reservoir_size"));
+
+  slash.InsertSVM(data, config.IntVal("batch_size"));
+
+  QueryResult<uint32_t> results;
+  auto run_queries = [&](const std::string& name) {
+    auto start = std::chrono::high_resolution_clock::now();
+    slash.QuerySVMSingleMachine(queries.View(), topk, results);
+    auto end = std::chrono::high_resolution_clock::now();
+    double elapsed = std::chrono::duration<double>(end - start).count();
+    LOG << name << ": " << Q << " queries in " << elapsed << " seconds, QPS = " << Q / elapsed
+        << std::endl;
+  };
+
+  run_queries("No deletes");
+
+  uint64_t step = std::max<uint64_t>(1, std::round(1 / config.DoubleVal("delete_fraction")));
+  std::vector<uint32_t> deleted;
+  for (uint32_t label = 0; label < N; label += step) {
+    deleted.push_back(label);
+  }
+  slash.Delete(deleted.size(), deleted.data());
+  run_queries("Deleted " + std::to_string(deleted.size()));
+
+  uint64_t leaked = 0;
+  for (uint64_t q = 0; q < Q; q++) {
+    for (uint64_t i = 0; i < results.len(q); i++) {
+      leaked += results[q][i] % step == 0;
+    }
+  }
+  LOG << "Deleted labels returned by queries = " << leaked << std::endl;
+
+  slash.Compact(config.DoubleVal("compact_fraction"));
+  run_queries("After compaction");
+
+  uint64_t U = std::min(Q, deleted.size());
+  CsrView updated{U, queries.indices, queries.values, queries.markers};
+  slash.Update(updated, deleted.data());
+  slash.QuerySVMSingleMachine(updated, topk, results);
+
+  uint64_t found = 0;
+  for (uint64_t q = 0; q < U; q++) {
+    found += results.len(q) > 0 && results[q][0] == deleted[q];
+  }
+  LOG << "Updated " << U << " labels, " << found << " returned as their own top result"
+      << std::endl;
+}
+
+/*
+ * Builds an index for each value of L and queries it with each probe count T, logging one row of
+ * index memory, QPS and recall per (L, T) so that multi-probe configurations with fewer tables
+ * can be compared against single probe ones on the same data.
+ */
+void MultiProbeBenchmark(const ConfigReader& config) {
+  BenchmarkInputs inputs(config, true);
+  uint64_t Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+  const auto& gtruths = inputs.gtruths;
+
+  std::stringstream header;
+  header << "L\tT\tmemory_mb\tqps";
+  for (uint32_t r = 0; r < config.Len("recall_k"); r++) {
+    header << "\trecall@" << config.IntVal("recall_k", r);
+  }
+  LOG << header.str() << std::endl;
+
+  QueryResult<uint32_t> results;
+  for (uint32_t l = 0; l < config.Len("L"); l++) {
+    uint64_t L = config.IntVal("L", l);
+    Slash<uint32_t> slash(config.IntVal("K"), L, config.IntVal("range_pow"),
+                          config.IntVal("reservoir_size"));
+    slash.InsertSVM(data, config.IntVal("batch_size"));
+
+    for (uint32_t t = 0; t < config.Len("probes"); t++) {
+      uint64_t T = config.IntVal("probes", t);
+      slash.SetQueryProbes(T);
+
+      auto start = std::chrono::high_resolution_clock::now();
+      slash.QuerySVMSingleMachine(queries.View(), topk, results);
+      auto end = std::chrono::high_resolution_clock::now();
+
+      std::stringstream row;
+      row << L << "\t" << T << "\t" << slash.IndexBytes() / (double)(1 << 20) << "\t"
+          << Q / std::chrono::duration<double>(end - start).count();
+      for (uint32_t r = 0; r < config.Len("recall_k"); r++) {
+        row << "\t" << Recall(results, gtruths, std::min(config.IntVal("recall_k", r), topk));
+      }
+      LOG << row.str() << std::endl;
+    }
+  }
+}
+
+/*
+ * Logs recall, QPS and the average number of tables visited by anytime queries for each
+ * table_budget with no deadline, then for each deadline_us with no table budget.
+ */
+void AnytimeBenchmark(const ConfigReader& config) {
+  BenchmarkInputs inputs(config, true);
+  uint64_t Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+  const auto& gtruths = inputs.gtruths;
+
+  Slash<uint32_t> slash(config.IntVal("K"), config.IntVal("L"), config.IntVal("range_pow"),
+                        config.IntVal("reservoir_size"));
+
+  slash.InsertSVM(data, config.IntVal("batch_size"));
+
+  QueryResult<uint32_t> results;
+  std::vector<uint64_t> tables_used(Q);
+  auto run = [&](uint64_t table_budget, uint64_t deadline_us) {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = deadline_us == 0 ? std::chrono::steady_clock::time_point::max()
+                                     : start + std::chrono::microseconds(deadline_us);
+    slash.QueryAnytime(queries.View(), topk, table_budget, deadline, results, tables_used.data());
+    auto end = std::chrono::steady_clock::now();
+
+    std::stringstream row;
+    row << (table_budget == UINT64_MAX ? std::string("all") : std::to_string(table_budget))
+        << "\t" << deadline_us << "\t"
+        << std::accumulate(tables_used.begin(), tables_used.end(), 0.0) / Q << "\t"
+        << Q / std::chrono::duration<double>(end - start).count();
+    for (uint32_t r = 0; r < config.Len("recall_k"); r++) {
+      row << "\t" << Recall(results, gtruths, std::min(config.IntVal("recall_k", r), topk));
+    }
+    LOG << row.str() << std::endl;
+  };
+
+  LOG << "table_budget\tdeadline_us\ttables_used\tqps\trecall@" << config.IntVal("recall_k")
+      << "..." << std::endl;
+  for (uint32_t b = 0; b < config.Len("table_budget"); b++) {
+    run(config.IntVal("table_budget", b), 0);
+  }
+  for (uint32_t d = 0; d < config.Len("deadline_us"); d++) {
+    run(UINT64_MAX, config.IntVal("deadline_us", d));
+  }
+}
+
+/*
+ * Times hashing, insertion and querying with the generic kernels and then with the kernels
+ * specialised for the configured (K, L, range_pow, reservoir_size), which must be listed in
+ * SLASH_FIXED_CONFIGS for the comparison to mean anything. Both paths must produce identical
+ * hashes. Query results are compared by recall since reservoir sampling makes the contents of
+ * overflowing buckets depend on thread scheduling.
+ */
+void KernelBenchmark(const ConfigReader& config) {
   uint64_t K = config.IntVal("K");
   uint64_t L = config.IntVal("L");
   uint64_t range_pow = config.IntVal("range_pow");
   uint64_t reservoir_size = config.IntVal("reservoir_size");
+  BenchmarkInputs inputs(config, true);
+  uint64_t N = inputs.N, Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+  const auto& gtruths = inputs.gtruths;
+
+  if (!IsFixedConfig(K, L, range_pow, reservoir_size)) {
+    LOG << "No specialised kernels for this configuration, both runs use the generic kernels"
+        << std::endl;
+  }
 
-  Slash slash(K, L, range_pow, reservoir_size);
+  auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  std::vector<uint32_t> data_hashes[2], query_hashes[2];
+  double hash_time[2], insert_time[2], query_time[2];
+  LOG << "kernel\thash_vps\tinsert_vps\tquery_qps\trecall@" << config.IntVal("recall_k")
+      << std::endl;
+  for (int fixed = 0; fixed < 2; fixed++) {
+    DOPH<uint32_t, uint32_t> hasher(K, L, range_pow);
+    HashTable<uint32_t, uint32_t> table(L, reservoir_size, range_pow);
+    hasher.SetFixedKernels(fixed);
+    table.SetFixedKernels(fixed);
+    data_hashes[fixed].resize(N * L);
+    query_hashes[fixed].resize(Q * L);
+
+    auto start = std::chrono::steady_clock::now();
+    hasher.Hash(data.View(), 0, N, data_hashes[fixed].data());
+    hash_time[fixed] = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    table.Insert(N, (uint32_t)0, data_hashes[fixed].data());
+    insert_time[fixed] = seconds_since(start);
+
+    QueryResult<uint32_t> results;
+    start = std::chrono::steady_clock::now();
+    hasher.Hash(queries.View(), 0, Q, query_hashes[fixed].data());
+    table.Query(Q, query_hashes[fixed].data(), topk, results);
+    query_time[fixed] = seconds_since(start);
+
+    LOG << (fixed ? "fixed" : "generic") << "\t" << N / hash_time[fixed] << "\t"
+        << N / insert_time[fixed] << "\t" << Q / query_time[fixed] << "\t"
+        << Recall(results, gtruths, std::min(config.IntVal("recall_k"), topk)) << std::endl;
+  }
+
+  bool identical = data_hashes[0] == data_hashes[1] && query_hashes[0] == query_hashes[1];
+  LOG << "Speedup: hash " << hash_time[0] / hash_time[1] << "x, insert "
+      << insert_time[0] / insert_time[1] << "x, query " << query_time[0] / query_time[1]
+      << "x, hashes identical = " << identical << std::endl;
+}
+
+/*
+ * DOPH for sparse vectors, or SRP when hash_family = "srp" for dense vectors of dim dimensions.
+ */
+template <typename Label_t>
+Hasher* MakeHasher(const ConfigReader& config, uint64_t K, uint64_t L, uint64_t range_pow) {
+  std::string family = config.Contains("hash_family") ? config.StrVal("hash_family") : "doph";
+  if (family == "srp") {
+    return new SRP(K, L, range_pow, config.IntVal("dim"));
+  }
+  if (family != "doph") {
+    throw std::invalid_argument("Invalid hash_family " + family + ", expected doph or srp");
+  }
+  return new DOPH<Label_t, uint32_t>(K, L, range_pow);
+}
+
+/*
+ * Answers the first rows of the data through the regular distributed query with k + 1 results,
+ * and logs on rank 0 the fraction of each row's k nearest other rows that the graph also holds,
+ * so that the self join can be checked against, and timed against, querying row by row. Rank 0
+ * also reads the whole graph and checks that every edge is held by both of its ends with the same
+ * count.
+ */
+template <typename Label_t>
+void VerifyKnnGraph(const ConfigReader& config, Slash<Label_t>& slash, uint64_t k,
+                    const std::string& graph_file) {
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  uint64_t rows = config.IntVal("knn_verify_rows");
+  uint64_t avg_dim = config.Contains("avg_dim") ? config.IntVal("avg_dim") : 0;
+  SvmDataset<Label_t> data = SvmDataset<Label_t>::ReadSvmDataset(
+      config.StrVal("data_file"), (Label_t)0, rows, avg_dim, config.IntVal("query_len"));
+
+  QueryResult<Label_t> results;
+  auto start = std::chrono::high_resolution_clock::now();
+  slash.QuerySVM(data.View(), k + 1, results);
+  auto end = std::chrono::high_resolution_clock::now();
+  if (rank != 0) {
+    return;
+  }
+
+  std::unordered_map<Label_t, std::vector<std::pair<Label_t, uint32_t>>> graph_rows;
+  KnnGraphReader<Label_t> reader(graph_file);
+  Label_t row;
+  std::vector<Label_t> neighbours;
+  std::vector<uint32_t> counts;
+  while (reader.Next(row, neighbours, counts)) {
+    auto& edges = graph_rows[row];
+    for (uint64_t i = 0; i < neighbours.size(); i++) {
+      edges.emplace_back(neighbours[i], counts[i]);
+    }
+  }
+
+  for (const auto& graph_row : graph_rows) {
+    for (const auto& edge : graph_row.second) {
+      auto other = graph_rows.find(edge.first);
+      Check(other != graph_rows.end() &&
+                std::find(other->second.begin(), other->second.end(),
+                          std::make_pair(graph_row.first, edge.second)) != other->second.end(),
+            "kNN edge " + std::to_string(graph_row.first) + " -> " + std::to_string(edge.first) +
+                " is held by both ends with the same count");
+    }
+  }
+
+  uint64_t expected = 0, found = 0;
+  for (uint64_t q = 0; q < rows; q++) {
+    const auto& graph_row = graph_rows[q];
+    for (uint64_t i = 0, kept = 0; i < results.len(q) && kept < k; i++) {
+      if (results[q][i] == q) {
+        continue;
+      }
+      kept++;
+      expected++;
+      found += std::find_if(graph_row.begin(), graph_row.end(), [&](const auto& edge) {
+                 return edge.first == results[q][i];
+               }) != graph_row.end();
+    }
+  }
+  LOG << "kNN graph holds " << (expected > 0 ? found / (double)expected : 1.0)
+      << " of the neighbours found by querying " << rows << " rows, which took "
+      << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+      << " milliseconds" << std::endl;
+}
+
+/*
+ * Builds the index with Label_t labels, then either serves queries, builds the kNN graph of the
+ * data, or runs the distributed query and evaluates the results on rank 0.
+ */
+template <typename Label_t>
+void Run(const ConfigReader& config, const std::string& mode) {
+  int rank, world_size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+  uint64_t K = config.IntVal("K");
+  uint64_t L = config.IntVal("L");
+  uint64_t range_pow = config.IntVal("range_pow");
+  uint64_t reservoir_size = config.IntVal("reservoir_size");
 
   uint64_t N = config.IntVal("data_len");
   uint64_t Q = config.IntVal("query_len");
   uint64_t topk = config.IntVal("topk");
-  uint64_t avg_dim = config.IntVal("avg_dim");
+  uint64_t avg_dim = config.Contains("avg_dim") ? config.IntVal("avg_dim") : 0;
   uint64_t batch_size = config.IntVal("batch_size");
 
   std::string data_file = config.StrVal("data_file");
   std::string query_file = config.StrVal("query_file");
 
-  slash.InsertSVM(data_file, N, Q, avg_dim, batch_size);
+  // Any format other than float keeps only quantized values of the evaluation data.
+  ValueFormat value_format = config.Contains("value_format")
+                                 ? ParseValueFormat(config.StrVal("value_format"))
+                                 : ValueFormat::Float;
+  bool quantize = value_format != ValueFormat::Float;
 
-  auto results = slash.QuerySVM(query_file, Q, avg_dim, topk);
+  // Datasets are sized exactly as they are read, so without an avg_dim hint the plan uses the mean
+  // row length of a sample of the data, taken on rank 0 since other ranks may not see data_file.
+  uint64_t plan_dim = avg_dim;
+  if (plan_dim == 0) {
+    if (rank == 0) {
+      auto sample = ReadSvmRowLengths(data_file, std::min<uint64_t>(N, 1000), Q);
+      plan_dim = std::accumulate(sample.begin(), sample.end(), (uint64_t)0) / sample.size() + 1;
+    }
+    MPI_Bcast(&plan_dim, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+  }
+
+  // With query_chunk set, queries are read, answered and evaluated query_chunk at a time, and the
+  // results go to result_file instead of being held for all Q queries.
+  bool stream = config.Contains("query_chunk");
+  uint64_t query_chunk = stream ? config.IntVal("query_chunk") : Q;
+  if (stream && query_chunk == 0) {
+    throw std::invalid_argument("query_chunk must be positive");
+  }
+  std::string result_file =
+      config.Contains("result_file") ? config.StrVal("result_file") : "slash_results.bin";
+
+  // Planned for the largest shard of an even row partition.
+  uint64_t local_n = (N + world_size - 1) / world_size;
+  uint64_t split_bits = config.Contains("split_bits") ? config.IntVal("split_bits") : 0;
+  uint64_t plan_probes = 1;
+  for (uint32_t t = 0; config.Contains("probes") && t < config.Len("probes"); t++) {
+    plan_probes = std::max(plan_probes, config.IntVal("probes", t));
+  }
+  MemoryParams params{K, L, range_pow, reservoir_size, sizeof(Label_t), local_n,
+                      std::min(Q, query_chunk), plan_dim, batch_size, topk,
+                      (uint64_t)omp_get_max_threads(), rank == 0 ? N : 0,
+                      quantize ? QuantizedRows::ValueBytes(value_format) : 0,
+                      split_bits > 0 ? (uint64_t)1 : 0, plan_probes};
+  if (config.Contains("memory_budget")) {
+    params = FitMemoryBudget(params, config.IntVal("memory_budget") << 20);
+    range_pow = params.rangePow;
+    reservoir_size = params.reservoirSize;
+    LOG << "memory_budget of " << config.IntVal("memory_budget") << " MB selects range_pow = "
+        << range_pow << " reservoir_size = " << reservoir_size << std::endl;
+  }
+  MemoryPlan plan = PlanMemory(params);
+  plan.Log();
+
+  Slash<Label_t> slash(MakeHasher<Label_t>(config, K, L, range_pow), reservoir_size);
+  auto report_memory = [&] {
+    LOG << "Memory (MB): planned " << plan.Total() / (double)(1 << 20) << " resident "
+        << ResidentBytes() / (double)(1 << 20) << " peak resident "
+        << PeakResidentBytes() / (double)(1 << 20) << ", index planned "
+        << (plan.tables + plan.counters) / (double)(1 << 20) << " actual "
+        << slash.IndexBytes() / (double)(1 << 20) << std::endl;
+  };
+
+  if (split_bits > 0) {
+    slash.EnableSplitting(split_bits, config.Contains("hot_factor") ? config.DoubleVal("hot_factor")
+                                                                    : DefaultHotFactor);
+  }
+
+  if (mode == "knn") {
+    slash.RetainSignatures();
+  }
+
+  std::string partition = config.Contains("partition") ? config.StrVal("partition") : "rows";
+  std::string ingest = config.Contains("ingest") ? config.StrVal("ingest") : "parallel";
+  if (ingest == "parallel") {
+    slash.InsertSVM(data_file, N, Q, avg_dim, batch_size,
+                    partition == "nnz" ? Partition::Nnz : Partition::Rows);
+  } else if (ingest == "scatter" || ingest == "scatter_node") {
+    slash.InsertSVMScatter(data_file, N, Q, avg_dim, batch_size,
+                           partition == "nnz" ? Partition::Nnz : Partition::Rows,
+                           ingest == "scatter_node");
+  } else {
+    throw std::invalid_argument("Invalid ingest " + ingest +
+                                ", expected parallel, scatter or scatter_node");
+  }
+  if (split_bits > 0) {
+    LOG << "Split " << slash.NumSplitBuckets() << " hot buckets" << std::endl;
+  }
+  if (config.Contains("probes")) {
+    slash.SetQueryProbes(config.IntVal("probes"));
+  }
+  if (config.Contains("query_cache_entries")) {
+    slash.EnableQueryCache(config.IntVal("query_cache_entries"));
+  }
+
+  if (mode == "server") {
+    Serve(config, slash);
+    report_memory();
+    return;
+  }
+
+  if (mode == "knn") {
+    uint64_t knn_k = config.IntVal("knn_k");
+    std::string graph_file =
+        config.Contains("graph_file") ? config.StrVal("graph_file") : "slash_graph.bin";
+    slash.BuildKnnGraph(knn_k, batch_size, graph_file);
+    if (config.Contains("knn_verify_rows")) {
+      VerifyKnnGraph(config, slash, knn_k, graph_file);
+    }
+    report_memory();
+    return;
+  }
+
+  QueryResult<Label_t> results;
+  if (stream) {
+    slash.QuerySVMStream(query_file, Q, avg_dim, topk, query_chunk, result_file);
+  } else {
+    results = slash.QuerySVM(query_file, Q, avg_dim, topk);
+  }
 
-  int rank;
-  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   if (rank != 0) {
-    return 0;
+    report_memory();
+    return;
   }
 
   LOG << "Reading data for evaluation" << std::endl;
-  SvmDataset<uint32_t> data =
-      SvmDataset<uint32_t>::ReadSvmDataset(data_file, (uint32_t)0, N, avg_dim, Q);
-  SvmDataset<uint32_t> queries =
-      SvmDataset<uint32_t>::ReadSvmDataset(query_file, (uint32_t)0, Q, avg_dim, 0);
+  SvmDataset<Label_t> data =
+      SvmDataset<Label_t>::ReadSvmDataset(data_file, (Label_t)0, N, avg_dim, Q);
+
+  std::unique_ptr<QuantizedRows> quantized;
+  if (quantize) {
+    quantized.reset(new QuantizedRows(data.View(), value_format));
+    data.ReleaseValues();
+    LOG << "Quantized evaluation values to " << ValueFormatName(value_format) << ", "
+        << quantized->Bytes() / (double)(1 << 20) << " MB" << std::endl;
+  }
+
+  auto gtruths = ReadGroundTruths(config.StrVal("gtruths"), Q, config.IntVal("gtruth_topk"));
 
   LOG << "Evaluating" << std::endl;
 
-  for (uint32_t i = 0; i < config.Len("sim_k"); i++) {
-    Eval<uint32_t>(data, queries, results, config.IntVal("sim_k", i));
+  // Sums over the queries of each per query average, divided by Q once every chunk is done.
+  std::vector<double> cosine_sums(config.Len("sim_k"), 0), recall_sums(config.Len("recall_k"), 0);
+  std::ifstream query_stream(query_file);
+  std::unique_ptr<QueryResultReader<Label_t>> reader;
+  if (stream) {
+    reader.reset(new QueryResultReader<Label_t>(result_file));
   }
+  std::vector<double> query_norms;
 
-  auto gtruths = ReadGroundTruths(config.StrVal("gtruths"), Q, config.IntVal("gtruth_topk"));
+  for (uint64_t done = 0; done < Q; done += query_chunk) {
+    uint64_t n = std::min(query_chunk, Q - done);
+    SvmDataset<Label_t> queries =
+        SvmDataset<Label_t>::ReadSvmDataset(query_stream, query_file, (Label_t)done, n, avg_dim);
+    if (stream && reader->Next(n, results) != n) {
+      throw std::runtime_error("Result file " + result_file + " has fewer than " +
+                               std::to_string(Q) + " queries");
+    }
 
+    if (quantize) {
+      query_norms.clear();
+      for (uint64_t q = 0; q < n; q++) {
+        query_norms.push_back(Magnitude(queries.Values(q), queries.Len(q)));
+      }
+    }
+    for (uint32_t i = 0; i < config.Len("sim_k"); i++) {
+      uint64_t sim_k = config.IntVal("sim_k", i);
+      double average = quantize ? QuantizedCosine(*quantized, queries, query_norms, results, sim_k)
+                                : ExactCosine(data, queries, results, sim_k);
+      cosine_sums[i] += n * average;
+    }
+    for (uint32_t i = 0; i < config.Len("recall_k"); i++) {
+      recall_sums[i] += n * Recall(results, gtruths, config.IntVal("recall_k", i), done);
+    }
+  }
+
+  for (uint32_t i = 0; i < config.Len("sim_k"); i++) {
+    LOG << "Average Cosine Similarity @" << config.IntVal("sim_k", i) << " = " << cosine_sums[i] / Q
+        << std::endl;
+  }
   for (uint32_t i = 0; i < config.Len("recall_k"); i++) {
     uint32_t eval_k = config.IntVal("recall_k", i);
     if (eval_k > topk) {
       LOG << "Cannot compute recall @ " << eval_k << " since topk = " << topk << std::endl;
       continue;
     }
+    LOG << "Recall @ " << eval_k << " is : " << recall_sums[i] / Q << std::endl;
+  }
+
+  report_memory();
+}
+
+/*
+ * Hashes a synthetic dataset whose vector lengths follow a log normal distribution, with the
+ * rows shuffled and then sorted longest first, under each HashSchedule. Logs vectors/sec and the
+ * spread of per thread busy time, where a max / mean near 1 means no thread sat idle.
+ */
+void ScheduleBenchmark(const ConfigReader& config) {
+  uint64_t N = config.IntVal("synthetic_rows");
+  double avg_nnz = config.DoubleVal("synthetic_avg_nnz");
+  double sigma = config.DoubleVal("synthetic_sigma");
+  uint64_t K = config.IntVal("K");
+  uint64_t L = config.IntVal("L");
+
+  std::mt19937_64 rng(42);
+  // exp(mu + sigma^2 / 2) is the mean of the log normal.
+  std::lognormal_distribution<double> length_dist(std::log(avg_nnz) - sigma * sigma / 2, sigma);
+  std::uniform_int_distribution<uint32_t> index_dist(0, (1 << 24) - 1);
+  std::vector<uint64_t> lengths(N);
+  for (auto& len : lengths) {
+    len = std::max<uint64_t>(1, std::min<double>(length_dist(rng), 1000 * avg_nnz));
+  }
+  uint64_t total = std::accumulate(lengths.begin(), lengths.end(), (uint64_t)0);
+
+  DOPH<uint32_t, uint32_t> hasher(K, L, config.IntVal("range_pow"));
+  hasher.SetProfiling(true);
+  std::vector<uint32_t> hashes(N * L);
+
+  LOG << "Synthetic rows = " << N << " nnz = " << total << " max row nnz = "
+      << *std::max_element(lengths.begin(), lengths.end()) << std::endl;
+  LOG << "order\tschedule\tvectors_per_sec\tbusy_min_s\tbusy_mean_s\tbusy_max_s\tmax/mean"
+      << std::endl;
+  for (bool sorted : {false, true}) {
+    if (sorted) {
+      std::sort(lengths.begin(), lengths.end(), std::greater<uint64_t>());
+    }
+    SvmDataset<uint32_t> data(N, total / N + 1, (uint32_t)0);
+    data.markers[0] = 0;
+    for (uint64_t i = 0; i < N; i++) {
+      data.markers[i + 1] = data.markers[i] + lengths[i];
+      for (uint64_t j = data.markers[i]; j < data.markers[i + 1]; j++) {
+        data.indices[j] = index_dist(rng);
+        data.values[j] = 1;
+      }
+    }
+
+    for (auto schedule : {HashSchedule::Static, HashSchedule::Balanced}) {
+      hasher.SetSchedule(schedule);
+      auto start = std::chrono::steady_clock::now();
+      hasher.Hash(data.View(), 0, N, hashes.data());
+      double elapsed =
+          std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      const auto& busy = hasher.BusySeconds();
+      double mean = std::accumulate(busy.begin(), busy.end(), 0.0) / busy.size();
+      double max = *std::max_element(busy.begin(), busy.end());
+      LOG << (sorted ? "sorted" : "shuffled") << "\t"
+          << (schedule == HashSchedule::Static ? "static" : "balanced") << "\t" << N / elapsed
+          << "\t" << *std::min_element(busy.begin(), busy.end()) << "\t" << mean << "\t" << max
+          << "\t" << max / mean << std::endl;
+    }
+  }
+}
+
+/*
+ * Evaluates every combination of the K, L, range_pow and reservoir_size lists in one run. The
+ * data and queries are loaded once and their min hashes computed once at the largest K * L and
+ * range_pow, after which each configuration only combines min hashes into bucket ids, builds its
+ * tables and queries them. Logs one row of memory, insert rate, QPS and recall per configuration,
+ * where insert rate and QPS exclude the shared min hash computation.
+ */
+void SweepBenchmark(const ConfigReader& config) {
+  BenchmarkInputs inputs(config, true);
+  uint64_t N = inputs.N, Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+  const auto& gtruths = inputs.gtruths;
+
+  auto max_of = [&](const std::string& key) {
+    uint64_t max = 0;
+    for (uint32_t i = 0; i < config.Len(key); i++) {
+      max = std::max<uint64_t>(max, config.IntVal(key, i));
+    }
+    return max;
+  };
+
+  DOPH<uint32_t, uint32_t> hasher(max_of("K"), max_of("L"), max_of("range_pow"));
+  uint64_t M = hasher.NumHashes();
+  std::vector<uint32_t> data_min(N * M), query_min(Q * M);
+  auto start = std::chrono::steady_clock::now();
+  hasher.MinHashes(data.View(), 0, N, data_min.data());
+  hasher.MinHashes(queries.View(), 0, Q, query_min.data());
+  LOG << "Computed " << M << " min hashes for " << N + Q << " vectors in "
+      << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+      << " seconds" << std::endl;
+
+  std::stringstream header;
+  header << "K\tL\trange_pow\treservoir_size\tmemory_mb\tinsert_vps\tqps";
+  for (uint32_t r = 0; r < config.Len("recall_k"); r++) {
+    header << "\trecall@" << config.IntVal("recall_k", r);
+  }
+  LOG << header.str() << std::endl;
+
+  std::vector<uint32_t> data_hashes, query_hashes;
+  QueryResult<uint32_t> results;
+  for (uint32_t k = 0; k < config.Len("K"); k++) {
+    for (uint32_t l = 0; l < config.Len("L"); l++) {
+      for (uint32_t p = 0; p < config.Len("range_pow"); p++) {
+        for (uint32_t r = 0; r < config.Len("reservoir_size"); r++) {
+          uint64_t K = config.IntVal("K", k), L = config.IntVal("L", l);
+          uint64_t range_pow = config.IntVal("range_pow", p);
+          uint64_t reservoir_size = config.IntVal("reservoir_size", r);
+          data_hashes.resize(N * L);
+          query_hashes.resize(Q * L);
+
+          HashTable<uint32_t, uint32_t> table(L, reservoir_size, range_pow);
+          start = std::chrono::steady_clock::now();
+          hasher.Combine(data_min.data(), N, K, L, range_pow, data_hashes.data());
+          table.Insert(N, (uint32_t)0, data_hashes.data());
+          double insert_time =
+              std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    double recall = 0.0;
-    for (uint32_t q = 0; q < Q; q++) {
-      uint32_t correct = 0;
-      uint32_t end = std::min<uint32_t>(eval_k, results.len(q));
-      for (uint32_t i = 0; i < end; i++) {
-        for (uint32_t j = 0; j < 100; j++) {
-          if (results[q][i] == gtruths.at(q).at(j)) {
-            correct++;
+          start = std::chrono::steady_clock::now();
+          hasher.Combine(query_min.data(), Q, K, L, range_pow, query_hashes.data());
+          table.Query(Q, query_hashes.data(), topk, results);
+          double query_time =
+              std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+          std::stringstream row;
+          row << K << "\t" << L << "\t" << range_pow << "\t" << reservoir_size << "\t"
+              << table.Bytes() / (double)(1 << 20) << "\t" << N / insert_time << "\t"
+              << Q / query_time;
+          for (uint32_t e = 0; e < config.Len("recall_k"); e++) {
+            row << "\t" << Recall(results, gtruths, std::min(config.IntVal("recall_k", e), topk));
           }
+          LOG << row.str() << std::endl;
         }
       }
-      recall += ((double)correct) / end;
     }
-    LOG << "Recall @ " << eval_k << " is : " << (recall / Q) << std::endl;
+  }
+}
+
+/*
+ * Queries a single machine index, then evaluates cosine similarity of the results against data
+ * values stored in each value_formats entry (all formats by default). Logs the value memory, the
+ * time to quantize, cosine similarities evaluated per second, and the average cosine at each sim_k
+ * with its difference from the exact scalar evaluation on the original floats.
+ */
+void QuantizedBenchmark(const ConfigReader& config) {
+  BenchmarkInputs inputs(config, false);
+  uint64_t N = inputs.N, Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+
+  Slash<uint32_t> slash(config.IntVal("K"), config.IntVal("L"), config.IntVal("range_pow"),
+                        config.IntVal("reservoir_size"));
+  slash.InsertSVM(data, config.IntVal("batch_size"));
+  QueryResult<uint32_t> results;
+  slash.QuerySVMSingleMachine(queries.View(), topk, results);
+
+  std::vector<double> query_norms;
+  for (uint64_t q = 0; q < Q; q++) {
+    query_norms.push_back(Magnitude(queries.Values(q), queries.Len(q)));
+  }
+  // Cosine similarities computed by one evaluation at every sim_k.
+  uint64_t pairs = 0;
+  for (uint32_t i = 0; i < config.Len("sim_k"); i++) {
+    for (uint64_t q = 0; q < Q; q++) {
+      pairs += std::min(config.IntVal("sim_k", i), results.len(q));
+    }
+  }
+
+  auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  std::stringstream header;
+  header << "format\tvalue_mb\tquantize_s\tcosines_per_sec";
+  for (uint32_t i = 0; i < config.Len("sim_k"); i++) {
+    header << "\tcosine@" << config.IntVal("sim_k", i) << "\tdelta";
+  }
+  LOG << header.str() << std::endl;
+
+  std::vector<double> exact;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < config.Len("sim_k"); i++) {
+    exact.push_back(ExactCosine(data, queries, results, config.IntVal("sim_k", i)));
+  }
+  double exact_time = seconds_since(start);
+
+  std::stringstream exact_row;
+  exact_row << "exact\t" << data.markers[N] * sizeof(float) / (double)(1 << 20) << "\t0\t"
+            << pairs / exact_time;
+  for (double cosine : exact) {
+    exact_row << "\t" << cosine << "\t0";
+  }
+  LOG << exact_row.str() << std::endl;
+
+  std::vector<std::string> formats = {"float", "fp16", "bf16", "int8"};
+  if (config.Contains("value_formats")) {
+    formats.clear();
+    for (uint32_t i = 0; i < config.Len("value_formats"); i++) {
+      formats.push_back(config.StrVal("value_formats", i));
+    }
+  }
+
+  for (const auto& name : formats) {
+    start = std::chrono::steady_clock::now();
+    QuantizedRows quantized(data.View(), ParseValueFormat(name));
+    double quantize_time = seconds_since(start);
+
+    std::vector<double> cosines;
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < config.Len("sim_k"); i++) {
+      cosines.push_back(
+          QuantizedCosine(quantized, queries, query_norms, results, config.IntVal("sim_k", i)));
+    }
+    double eval_time = seconds_since(start);
+
+    std::stringstream row;
+    row << name << "\t" << quantized.Bytes() / (double)(1 << 20) << "\t" << quantize_time << "\t"
+        << pairs / eval_time;
+    for (uint32_t i = 0; i < cosines.size(); i++) {
+      row << "\t" << cosines[i] << "\t" << cosines[i] - exact[i];
+    }
+    LOG << row.str() << std::endl;
+  }
+}
+
+/*
+ * Replays a stream of cache_stream_len queries drawn from the query file with Zipf(zipf_s)
+ * popularity, in batches of bench_query_batch, against the same index with and without a cache of
+ * each query_cache_entries. Logs QPS, batch latency, hit rate and cache memory, and checks that
+ * every cached result equals the uncached one.
+ */
+void CacheBenchmark(const ConfigReader& config) {
+  BenchmarkInputs inputs(config, false);
+  uint64_t Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+  uint64_t stream_len = config.IntVal("cache_stream_len");
+  uint64_t query_batch = config.IntVal("bench_query_batch");
+  double zipf_s = config.DoubleVal("zipf_s");
+
+  Slash<uint32_t> slash(config.IntVal("K"), config.IntVal("L"), config.IntVal("range_pow"),
+                        config.IntVal("reservoir_size"));
+  slash.InsertSVM(data, config.IntVal("batch_size"));
+
+  // Popularity rank r is drawn with probability proportional to 1 / (r + 1)^s, and ranks are
+  // shuffled onto queries so that the hot queries are not simply the first ones in the file.
+  std::mt19937_64 rng(7);
+  std::vector<double> cdf(Q);
+  double total = 0;
+  for (uint64_t r = 0; r < Q; r++) {
+    total += 1 / std::pow(r + 1, zipf_s);
+    cdf[r] = total;
+  }
+  std::vector<uint64_t> rank_to_query(Q);
+  std::iota(rank_to_query.begin(), rank_to_query.end(), 0);
+  std::shuffle(rank_to_query.begin(), rank_to_query.end(), rng);
+  std::uniform_real_distribution<double> uniform(0, total);
+
+  std::vector<uint32_t> stream_indices;
+  std::vector<float> stream_values;
+  std::vector<uint64_t> stream_markers = {0};
+  std::unordered_set<uint64_t> distinct;
+  for (uint64_t i = 0; i < stream_len; i++) {
+    uint64_t r = std::lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin();
+    uint64_t q = rank_to_query[std::min(r, Q - 1)];
+    distinct.insert(q);
+    stream_indices.insert(stream_indices.end(), queries.Indices(q),
+                          queries.Indices(q) + queries.Len(q));
+    stream_values.insert(stream_values.end(), queries.Values(q),
+                         queries.Values(q) + queries.Len(q));
+    stream_markers.push_back(stream_indices.size());
+  }
+  LOG << "Zipf stream of " << stream_len << " queries with s = " << zipf_s << " has "
+      << distinct.size() << " distinct queries" << std::endl;
+
+  uint64_t num_batches = (stream_len + query_batch - 1) / query_batch;
+  std::vector<QueryResult<uint32_t>> expected(num_batches);
+  auto replay = [&](bool check) {
+    LatencyStats latencies;
+    uint64_t mismatched = 0;
+    QueryResult<uint32_t> results;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t b = 0; b < num_batches; b++) {
+      uint64_t offset = b * query_batch;
+      uint64_t cnt = std::min(stream_len, offset + query_batch) - offset;
+      CsrView batch{cnt, stream_indices.data(), stream_values.data(),
+                    stream_markers.data() + offset};
+      auto batch_start = std::chrono::steady_clock::now();
+      slash.QuerySVMSingleMachine(batch, topk, check ? results : expected[b]);
+      latencies.Record(std::chrono::duration<double, std::micro>(
+                           std::chrono::steady_clock::now() - batch_start)
+                           .count());
+      for (uint64_t q = 0; check && q < cnt; q++) {
+        mismatched += results.len(q) != expected[b].len(q) ||
+                      !std::equal(results[q], results[q] + results.len(q), expected[b][q]);
+      }
+    }
+    double elapsed =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    latencies.Log("Replay", elapsed, "batches");
+    LOG << "QPS = " << stream_len / elapsed << " mismatched results = " << mismatched
+        << std::endl;
+    return elapsed;
+  };
+
+  LOG << "Without cache" << std::endl;
+  double uncached = replay(false);
+
+  for (uint32_t i = 0; i < config.Len("query_cache_entries"); i++) {
+    uint64_t entries = config.IntVal("query_cache_entries", i);
+    slash.EnableQueryCache(entries);
+    LOG << "Cache of " << entries << " entries" << std::endl;
+    double cached = replay(true);
+    slash.Cache()->Log("Query cache");
+    LOG << "Speedup = " << uncached / cached << "x" << std::endl;
+  }
+}
+
+/*
+ * Hashes synthetic_rows dense Gaussian vectors of each of srp_dims dimensions with SRP, using the
+ * blocked kernel and then projecting one nonzero at a time, and logs vectors/sec for both along
+ * with the fraction of bucket ids on which they agree.
+ */
+void SrpBenchmark(const ConfigReader& config) {
+  uint64_t N = config.IntVal("synthetic_rows");
+  uint64_t K = config.IntVal("K");
+  uint64_t L = config.IntVal("L");
+  uint64_t range_pow = config.IntVal("range_pow");
+
+  std::vector<uint64_t> dims = {128, 256, 512, 1024};
+  if (config.Contains("srp_dims")) {
+    dims.clear();
+    for (uint32_t i = 0; i < config.Len("srp_dims"); i++) {
+      dims.push_back(config.IntVal("srp_dims", i));
+    }
+  }
+
+  auto seconds_since = [](std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  std::mt19937 rng(17);
+  std::normal_distribution<float> normal;
+  LOG << "dim\tblocked_vps\tper_nonzero_vps\tspeedup\tagreement" << std::endl;
+  for (uint64_t dim : dims) {
+    SvmDataset<uint32_t> data(N, dim, (uint32_t)0);
+    for (uint64_t i = 0; i <= N; i++) {
+      data.markers[i] = i * dim;
+    }
+    for (uint64_t j = 0; j < N * dim; j++) {
+      data.indices[j] = j % dim;
+      data.values[j] = normal(rng);
+    }
+
+    SRP hasher(K, L, range_pow, dim);
+    std::vector<uint32_t> hashes[2];
+    double seconds[2];
+    for (int blocked = 1; blocked >= 0; blocked--) {
+      hasher.SetBlocked(blocked);
+      hashes[blocked].resize(N * L);
+      auto start = std::chrono::steady_clock::now();
+      hasher.Hash(data.View(), 0, N, hashes[blocked].data());
+      seconds[blocked] = seconds_since(start);
+    }
+
+    uint64_t agree = 0;
+    for (uint64_t i = 0; i < N * L; i++) {
+      agree += hashes[0][i] == hashes[1][i];
+    }
+    LOG << dim << "\t" << N / seconds[1] << "\t" << N / seconds[0] << "\t"
+        << seconds[0] / seconds[1] << "\t" << (double)agree / (N * L) << std::endl;
+  }
+}
+
+/*
+ * Builds an index for each value of split_bits, 0 meaning no splitting, with the same K, L,
+ * range_pow and reservoir_size, and logs the number of split buckets, index memory, the mean
+ * number of bucket slots scanned per query, QPS and recall. Hot buckets show up with a narrow
+ * range_pow or data dominated by frequent features.
+ */
+void SplitBenchmark(const ConfigReader& config) {
+  BenchmarkInputs inputs(config, true);
+  uint64_t Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+  const auto& gtruths = inputs.gtruths;
+  double hot_factor = config.Contains("hot_factor") ? config.DoubleVal("hot_factor")
+                                                    : DefaultHotFactor;
+
+  std::stringstream header;
+  header << "split_bits\tsplit_buckets\tmemory_mb\tscan_per_query\tqps";
+  for (uint32_t r = 0; r < config.Len("recall_k"); r++) {
+    header << "\trecall@" << config.IntVal("recall_k", r);
+  }
+  LOG << header.str() << std::endl;
+
+  QueryResult<uint32_t> results;
+  for (uint32_t b = 0; b < config.Len("split_bits"); b++) {
+    uint64_t split_bits = config.IntVal("split_bits", b);
+    Slash<uint32_t> slash(config.IntVal("K"), config.IntVal("L"), config.IntVal("range_pow"),
+                          config.IntVal("reservoir_size"));
+    if (split_bits > 0) {
+      slash.EnableSplitting(split_bits, hot_factor);
+    }
+    slash.InsertSVM(data, config.IntVal("batch_size"));
+
+    auto start = std::chrono::high_resolution_clock::now();
+    slash.QuerySVMSingleMachine(queries.View(), topk, results);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::stringstream row;
+    row << split_bits << "\t" << slash.NumSplitBuckets() << "\t"
+        << slash.IndexBytes() / (double)(1 << 20) << "\t"
+        << slash.ScanSize(queries.View()) / (double)Q << "\t"
+        << Q / std::chrono::duration<double>(end - start).count();
+    for (uint32_t r = 0; r < config.Len("recall_k"); r++) {
+      row << "\t" << Recall(results, gtruths, std::min(config.IntVal("recall_k", r), topk));
+    }
+    LOG << row.str() << std::endl;
+  }
+}
+
+/*
+ * Gives every data row a uniform random attribute and, for each fraction in filter_selectivity,
+ * answers the queries restricted to the rows whose attribute falls in that fraction of the range,
+ * once with the filter applied while the buckets are scanned and once by over fetching topk /
+ * selectivity unfiltered results and dropping the rest afterwards. Logs QPS, the mean number of
+ * results per query and their mean cosine similarity for both.
+ */
+void FilterBenchmark(const ConfigReader& config) {
+  BenchmarkInputs inputs(config, false);
+  uint64_t N = inputs.N, Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+
+  Slash<uint32_t> slash(config.IntVal("K"), config.IntVal("L"), config.IntVal("range_pow"),
+                        config.IntVal("reservoir_size"));
+  slash.InsertSVM(data, config.IntVal("batch_size"));
+
+  constexpr uint32_t AttributeRange = 1000000;
+  std::mt19937 rng(11);
+  std::uniform_int_distribution<uint32_t> attribute(0, AttributeRange - 1);
+  std::vector<uint32_t> labels(N), values(N);
+  std::iota(labels.begin(), labels.end(), 0);
+  for (uint64_t i = 0; i < N; i++) {
+    values[i] = attribute(rng);
+  }
+  slash.SetAttributes(N, labels.data(), values.data());
+
+  auto filled = [](const QueryResult<uint32_t>& results) {
+    uint64_t total = 0;
+    for (uint64_t q = 0; q < results.len(); q++) {
+      total += results.len(q);
+    }
+    return total / (double)results.len();
+  };
+
+  LOG << "selectivity\tmatching\tfilter_ms\tpushed_qps\tpushed_results\tpushed_cosine"
+      << "\tfetch_k\tpost_qps\tpost_results\tpost_cosine" << std::endl;
+
+  QueryResult<uint32_t> pushed, fetched, post;
+  for (uint32_t s = 0; s < config.Len("filter_selectivity"); s++) {
+    double selectivity = config.DoubleVal("filter_selectivity", s);
+    uint32_t hi = std::max(1.0, std::min<double>(AttributeRange, selectivity * AttributeRange)) - 1;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    LabelBitmap filter;
+    uint64_t matching = slash.FilterByAttribute(0, hi, filter);
+    auto filter_end = std::chrono::high_resolution_clock::now();
+    slash.QuerySVMSingleMachine(queries.View(), topk, pushed, &filter);
+    auto pushed_end = std::chrono::high_resolution_clock::now();
+
+    uint64_t fetch_k = std::min<uint64_t>(N, std::ceil(topk / selectivity));
+    slash.QuerySVMSingleMachine(queries.View(), fetch_k, fetched);
+    post.Reset(Q, topk);
+    for (uint64_t q = 0; q < Q; q++) {
+      uint64_t len = 0;
+      for (uint64_t i = 0; i < fetched.len(q) && len < topk; i++) {
+        if (filter.Test(fetched[q][i])) {
+          post[q][len++] = fetched[q][i];
+        }
+      }
+      post.len(q) = len;
+    }
+    auto post_end = std::chrono::high_resolution_clock::now();
+
+    LOG << selectivity << "\t" << matching << "\t"
+        << std::chrono::duration<double, std::milli>(filter_end - start).count() << "\t"
+        << Q / std::chrono::duration<double>(pushed_end - filter_end).count() << "\t"
+        << filled(pushed) << "\t" << ExactCosine(data, queries, pushed, topk) << "\t" << fetch_k
+        << "\t" << Q / std::chrono::duration<double>(post_end - pushed_end).count() << "\t"
+        << filled(post) << "\t" << ExactCosine(data, queries, post, topk) << std::endl;
+  }
+}
+
+/*
+ * Answers offline batches of each size in query_batches, drawn in turn from the query file and
+ * then the data rows so that the batch repeats as little as possible, once query major and once
+ * bucket major. Logs QPS and the MB of bucket slots each order reads, an estimate of the DRAM
+ * traffic of the scan from slot counts rather than a measurement, along with the order Auto picks
+ * and whether both orders agree on every result.
+ */
+void BatchOrderBenchmark(const ConfigReader& config) {
+  uint64_t K = config.IntVal("K");
+  uint64_t L = config.IntVal("L");
+  uint64_t range_pow = config.IntVal("range_pow");
+  BenchmarkInputs inputs(config, false);
+  uint64_t N = inputs.N, Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+
+  DOPH<uint32_t, uint32_t> hasher(K, L, range_pow);
+  HashTable<uint32_t, uint32_t> table(L, config.IntVal("reservoir_size"), range_pow);
+  std::vector<uint32_t> pool((Q + N) * L);
+  hasher.Hash(queries.View(), 0, Q, pool.data());
+  hasher.Hash(data.View(), 0, N, pool.data() + Q * L);
+  table.Insert(N, (uint32_t)0, pool.data() + Q * L);
+
+  LOG << "queries\tdistinct\tauto\tquery_major_qps\tbucket_major_qps\tspeedup"
+      << "\tquery_major_est_scan_mb\tbucket_major_est_scan_mb\tidentical" << std::endl;
+
+  std::vector<uint32_t> batch;
+  QueryResult<uint32_t> results[2];
+  for (uint32_t b = 0; b < config.Len("query_batches"); b++) {
+    uint64_t n = config.IntVal("query_batches", b);
+    batch.resize(n * L);
+    for (uint64_t q = 0; q < n; q++) {
+      std::copy_n(pool.data() + q % (Q + N) * L, L, batch.data() + q * L);
+    }
+
+    double seconds[2], scan_mb[2];
+    QueryOrder orders[2] = {QueryOrder::QueryMajor, QueryOrder::BucketMajor};
+    for (int o = 0; o < 2; o++) {
+      table.SetQueryOrder(orders[o]);
+      auto start = std::chrono::steady_clock::now();
+      table.Query(n, batch.data(), topk, results[o]);
+      seconds[o] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      scan_mb[o] = table.ScanSize(n, batch.data(), 1, orders[o]) * sizeof(uint32_t) /
+                   (double)(1 << 20);
+    }
+    table.SetQueryOrder(QueryOrder::Auto);
+
+    bool identical = true;
+    for (uint64_t q = 0; q < n && identical; q++) {
+      identical = results[0].len(q) == results[1].len(q) &&
+                  std::equal(results[0][q], results[0][q] + results[0].len(q), results[1][q]);
+    }
+    LOG << n << "\t" << std::min(n, Q + N) << "\t"
+        << (table.PrefersBucketMajor(n) ? "bucket_major" : "query_major") << "\t"
+        << n / seconds[0] << "\t" << n / seconds[1] << "\t" << seconds[0] / seconds[1] << "\t"
+        << scan_mb[0] << "\t" << scan_mb[1] << "\t" << identical << std::endl;
+  }
+}
+
+/*
+ * Dot products of small random rows in every value format, including empty rows and lengths on
+ * both sides of the 8 wide AVX2 blocks, must be within the rounding error of the format of the
+ * fp32 scalar product.
+ */
+void CheckQuantizedDot() {
+  std::mt19937 rng(23);
+  std::uniform_int_distribution<uint32_t> index(0, 255);
+  std::uniform_real_distribution<float> magnitude(0.1, 1);
+  std::vector<uint32_t> indices;
+  std::vector<float> values;
+  std::vector<uint64_t> markers = {0};
+  for (uint64_t len : {0, 1, 7, 8, 9, 16, 17, 33, 64, 100, 0}) {
+    std::vector<uint32_t> row;
+    while (row.size() < len) {
+      row.push_back(index(rng));
+      std::sort(row.begin(), row.end());
+      row.erase(std::unique(row.begin(), row.end()), row.end());
+    }
+    for (uint32_t i : row) {
+      indices.push_back(i);
+      values.push_back(rng() & 1 ? magnitude(rng) : -magnitude(rng));
+    }
+    markers.push_back(indices.size());
+  }
+  CsrView rows{markers.size() - 1, indices.data(), values.data(), markers.data()};
+
+  for (auto format :
+       {ValueFormat::Float, ValueFormat::Fp16, ValueFormat::Bf16, ValueFormat::Int8}) {
+    QuantizedRows quantized(rows, format);
+    for (uint64_t r = 0; r < rows.len; r++) {
+      double row_max = 0;
+      for (uint64_t i = 0; i < rows.Len(r); i++) {
+        row_max = std::max<double>(row_max, std::abs(rows.Values(r)[i]));
+      }
+      for (uint64_t q = 0; q < rows.len; q++) {
+        // The error of a stored value is half a unit in its last place, and the products are
+        // summed in float.
+        double exact = 0, bound = 1e-7;
+        for (uint64_t a = 0, b = 0; a < rows.Len(q) && b < rows.Len(r);) {
+          if (rows.Indices(q)[a] != rows.Indices(r)[b]) {
+            rows.Indices(q)[a] < rows.Indices(r)[b] ? a++ : b++;
+            continue;
+          }
+          double x = rows.Values(q)[a++], y = rows.Values(r)[b++];
+          double error = format == ValueFormat::Fp16   ? std::abs(y) / 2048
+                         : format == ValueFormat::Bf16 ? std::abs(y) / 256
+                         : format == ValueFormat::Int8 ? row_max / 254
+                                                       : 0;
+          exact += x * y;
+          bound += std::abs(x) * error + 1e-5 * std::abs(x * y);
+        }
+        double dot = quantized.Dot(rows.Indices(q), rows.Values(q), rows.Len(q), r);
+        Check(std::abs(dot - exact) <= bound,
+              std::string(ValueFormatName(format)) + " dot of rows " + std::to_string(q) +
+                  " and " + std::to_string(r) + " is " + std::to_string(dot) + ", expected " +
+                  std::to_string(exact));
+      }
+    }
+  }
+  LOG << "Quantized dot products match fp32 in every format" << std::endl;
+}
+
+/*
+ * Fills one bucket of a small table past its hot threshold so that it splits, then inserts one
+ * more label into every sub bucket. A query routed to a sub bucket must only return labels whose
+ * secondary bits are its own, and must find the label inserted after the split.
+ */
+void CheckSplitRouting() {
+  constexpr uint64_t RangePow = 4, Reservoir = 8, SplitBits = 2, Fanout = 1 << SplitBits;
+  constexpr uint32_t LateLabels = 100;
+  HashTable<uint32_t, uint32_t> table(1, Reservoir, RangePow);
+  table.EnableSplitting(SplitBits, 1);
+
+  // Every label goes to bucket 0, sub bucket label % Fanout.
+  auto hash_of = [&](uint32_t label) { return (uint32_t)(label % Fanout << RangePow); };
+  std::vector<uint32_t> hashes;
+  for (uint32_t label = 0; label <= Reservoir; label++) {
+    hashes.push_back(hash_of(label));
+  }
+  table.Insert(hashes.size(), (uint32_t)0, hashes.data());
+  Check(table.NumSplitBuckets() == 1, "a bucket past its hot threshold is split");
+
+  hashes.clear();
+  for (uint32_t label = LateLabels; label < LateLabels + Fanout; label++) {
+    hashes.push_back(hash_of(label));
+  }
+  table.Insert(hashes.size(), LateLabels, hashes.data());
+
+  QueryResult<uint32_t> results;
+  table.Query(Fanout, hashes.data(), 2 * Reservoir, results);
+  for (uint64_t sub = 0; sub < Fanout; sub++) {
+    for (uint64_t i = 0; i < results.len(sub); i++) {
+      Check(results[sub][i] % Fanout == sub,
+            "sub bucket " + std::to_string(sub) + " only returns its own labels");
+    }
+    Check(std::count(results[sub], results[sub] + results.len(sub), LateLabels + sub) == 1,
+          "sub bucket " + std::to_string(sub) + " holds the label inserted after the split");
+  }
+  LOG << "Split buckets route queries to their own sub buckets" << std::endl;
+}
+
+/*
+ * Runs the quantized and split checks, then builds an index of the front half of the data with a
+ * query cache and checks that cached results equal the uncached ones, read through a filter of
+ * every label since filtered queries bypass the cache, after inserting the back half, deleting
+ * every third label, compacting and updating. Tombstoned labels must not be returned, and a
+ * filtered query must only return labels in its filter. Throws std::runtime_error at the first
+ * invariant that does not hold.
+ */
+void CheckInvariants(const ConfigReader& config) {
+  CheckQuantizedDot();
+  CheckSplitRouting();
+
+  BenchmarkInputs inputs(config, false);
+  uint64_t N = inputs.N, Q = inputs.Q, topk = inputs.topk;
+  auto &data = inputs.data, &queries = inputs.queries;
+  uint64_t batch_size = config.IntVal("batch_size");
+
+  Slash<uint32_t> slash(config.IntVal("K"), config.IntVal("L"), config.IntVal("range_pow"),
+                        config.IntVal("reservoir_size"));
+  uint64_t half = N / 2;
+  slash.InsertSVM(CsrView{half, data.indices, data.values, data.markers}, (uint32_t)0, batch_size);
+  slash.EnableQueryCache(Q);
+
+  LabelBitmap everything(N);
+  for (uint32_t label = 0; label < N; label++) {
+    everything.Set(label);
+  }
+  QueryResult<uint32_t> cached, uncached;
+  auto check_cache = [&](const std::string& after) {
+    slash.QuerySVMSingleMachine(queries.View(), topk, cached);
+    slash.QuerySVMSingleMachine(queries.View(), topk, uncached, &everything);
+    for (uint64_t q = 0; q < Q; q++) {
+      Check(cached.len(q) == uncached.len(q) &&
+                std::equal(cached[q], cached[q] + cached.len(q), uncached[q]),
+            "cached results of query " + std::to_string(q) + " are current after " + after);
+    }
+  };
+  auto check_deleted = [&](const std::string& after) {
+    for (uint64_t q = 0; q < Q; q++) {
+      for (uint64_t i = 0; i < cached.len(q); i++) {
+        Check(cached[q][i] % 3 != 0,
+              "deleted label " + std::to_string(cached[q][i]) + " is not returned after " + after);
+      }
+    }
+  };
+
+  slash.QuerySVMSingleMachine(queries.View(), topk, cached);
+  check_cache("a repeated query");
+  Check(slash.Cache()->GetStats().hits > 0, "a repeated query hits the cache");
+
+  slash.InsertSVM(CsrView{N - half, data.indices, data.values, data.markers + half},
+                  (uint32_t)half, batch_size);
+  check_cache("an insert");
+
+  std::vector<uint32_t> deleted;
+  for (uint32_t label = 0; label < N; label += 3) {
+    deleted.push_back(label);
+  }
+  slash.Delete(deleted.size(), deleted.data());
+  check_cache("a delete");
+  check_deleted("a delete");
+
+  slash.Compact(0);
+  check_cache("a compaction");
+  check_deleted("a compaction");
+
+  uint64_t U = std::min(Q, deleted.size());
+  slash.Update(CsrView{U, queries.indices, queries.values, queries.markers}, deleted.data());
+  check_cache("an update");
+  LOG << "Cached results stay current across inserts, deletes, compactions and updates, and "
+         "deleted labels are not returned"
+      << std::endl;
+
+  std::mt19937 rng(29);
+  std::vector<uint32_t> labels(N), values(N);
+  std::iota(labels.begin(), labels.end(), 0);
+  for (uint64_t i = 0; i < N; i++) {
+    values[i] = rng() % 100;
+  }
+  slash.SetAttributes(N, labels.data(), values.data());
+  LabelBitmap filter(N);
+  slash.FilterByAttribute(0, 9, filter);
+  QueryResult<uint32_t> filtered;
+  slash.QuerySVMSingleMachine(queries.View(), topk, filtered, &filter);
+  for (uint64_t q = 0; q < Q; q++) {
+    for (uint64_t i = 0; i < filtered.len(q); i++) {
+      Check(values[filtered[q][i]] < 10,
+            "filtered query " + std::to_string(q) + " only returns labels in its filter");
+    }
+  }
+  LOG << "Filtered queries only return labels in their filter" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    std::cerr << "Invalid arguments, usage '$ ./slash <config file name>'" << std::endl;
+    return 1;
+  }
+
+  ConfigReader config(argv[1]);
+
+  InitHelper _i_(config.StrVal("logfile"));
+
+  config.PrintConfigVals();
+
+  std::string mode = config.Contains("mode") ? config.StrVal("mode") : "eval";
+  if (mode == "concurrent") {
+    ConcurrentBenchmark(config);
+    return 0;
+  }
+  if (mode == "delete") {
+    DeleteBenchmark(config);
+    return 0;
+  }
+  if (mode == "multiprobe") {
+    MultiProbeBenchmark(config);
+    return 0;
+  }
+  if (mode == "anytime") {
+    AnytimeBenchmark(config);
+    return 0;
+  }
+  if (mode == "kernels") {
+    KernelBenchmark(config);
+    return 0;
+  }
+  if (mode == "schedule") {
+    ScheduleBenchmark(config);
+    return 0;
+  }
+  if (mode == "sweep") {
+    SweepBenchmark(config);
+    return 0;
+  }
+  if (mode == "quantized") {
+    QuantizedBenchmark(config);
+    return 0;
+  }
+  if (mode == "cache") {
+    CacheBenchmark(config);
+    return 0;
+  }
+  if (mode == "srp") {
+    SrpBenchmark(config);
+    return 0;
+  }
+  if (mode == "split") {
+    SplitBenchmark(config);
+    return 0;
+  }
+  if (mode == "filter") {
+    FilterBenchmark(config);
+    return 0;
+  }
+  if (mode == "batch_order") {
+    BatchOrderBenchmark(config);
+    return 0;
+  }
+  if (mode == "check") {
+    CheckInvariants(config);
+    return 0;
+  }
+
+  // 64-bit labels are needed once the vectors across all ranks no longer fit in 32 bits.
+  uint64_t label_bits = config.Contains("label_bits") ? config.IntVal("label_bits") : 32;
+  if (label_bits == 32) {
+    Run<uint32_t>(config, mode);
+  } else if (label_bits == 64) {
+    Run<uint64_t>(config, mode);
+  } else {
+    LOG << "Invalid label_bits " << label_bits << ", expected 32 or 64" << std::endl;
+    return 1;
   }
 
   return 0;
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+/*
+ * Concurrent bitmap over labels. Pages of PageBits bits are allocated the first time a bit in
+ * them is set, and directories of DirPages page pointers the first time one of their pages is,
+ * so memory scales with the range of labels actually marked rather than with maxLabels. Set,
+ * Clear and Test are lock free and may run concurrently with each other.
+ */
+class LabelBitmap {
+ public:
+  static constexpr uint64_t PageShift = 16;
+  static constexpr uint64_t PageBits = 1ULL << PageShift;
+  static constexpr uint64_t PageWords = PageBits / 64;
+  static constexpr uint64_t DirShift = 16;
+  static constexpr uint64_t DirPages = 1ULL << DirShift;
+  static constexpr uint64_t DirLabels = DirPages * PageBits;
+
+  explicit LabelBitmap(uint64_t maxLabels = 1ULL << 32)
+      : numDirs((maxLabels - 1) / DirLabels + 1), count(0) {
+    dirs = new std::atomic<Directory*>[numDirs]();
+  }
+
+  LabelBitmap(const LabelBitmap& other) = delete;
+  LabelBitmap& operator=(const LabelBitmap& other) = delete;
+
+  // Returns true if the bit was previously clear.
+  bool Set(uint64_t label) {
+    uint64_t bit = 1ULL << (label & 63);
+    uint64_t old = GetPage(label, true)[WordIdx(label)].fetch_or(bit, std::memory_order_release);
+    if (old & bit) {
+      return false;
+    }
+    count.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Returns true if the bit was previously set.
+  bool Clear(uint64_t label) {
+    Page* page = GetPage(label, false);
+    if (page == nullptr) {
+      return false;
+    }
+    uint64_t bit = 1ULL << (label & 63);
+    uint64_t old = page[WordIdx(label)].fetch_and(~bit, std::memory_order_release);
+    if (!(old & bit)) {
+      return false;
+    }
+    count.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool Test(uint64_t label) const {
+    uint64_t d = label / DirLabels;
+    if (d >= numDirs) {
+      return false;
+    }
+    Directory* dir = dirs[d].load(std::memory_order_acquire);
+    if (dir == nullptr) {
+      return false;
+    }
+    Page* page = dir[PageIdx(label)].load(std::memory_order_acquire);
+    return page != nullptr &&
+           (page[WordIdx(label)].load(std::memory_order_acquire) & (1ULL << (label & 63)));
+  }
+
+  uint64_t Count() const { return count.load(std::memory_order_relaxed); }
+
+  bool Empty() const { return Count() == 0; }
+
+  // Clears every bit but keeps the allocated pages for reuse.
+  void ClearAll() {
+    ForEachPage([](Page* page) {
+      for (uint64_t w = 0; w < PageWords; w++) {
+        page[w].store(0, std::memory_order_relaxed);
+      }
+    });
+    count.store(0, std::memory_order_release);
+  }
+
+  uint64_t Bytes() const {
+    uint64_t allocatedDirs = 0, allocatedPages = 0;
+    for (uint64_t d = 0; d < numDirs; d++) {
+      allocatedDirs += dirs[d].load(std::memory_order_relaxed) != nullptr;
+    }
+    ForEachPage([&](Page*) { allocatedPages++; });
+    return numDirs * sizeof(void*) + allocatedDirs * DirPages * sizeof(void*) +
+           allocatedPages * PageWords * sizeof(uint64_t);
+  }
+
+  ~LabelBitmap() {
+    ForEachPage([](Page* page) { delete[] page; });
+    for (uint64_t d = 0; d < numDirs; d++) {
+      delete[] dirs[d].load();
+    }
+    delete[] dirs;
+  }
+
+ private:
+  using Page = std::atomic<uint64_t>;
+  using Directory = std::atomic<Page*>;
+
+  static constexpr uint64_t PageIdx(uint64_t label) {
+    return (label >> PageShift) & (DirPages - 1);
+  }
+
+  static constexpr uint64_t WordIdx(uint64_t label) { return (label & (PageBits - 1)) >> 6; }
+
+  // Loads slot, or if it is empty and create is set installs a fresh zeroed array of len entries.
+  template <typename T>
+  static T* LoadOrCreate(std::atomic<T*>& slot, uint64_t len, bool create) {
+    T* current = slot.load(std::memory_order_acquire);
+    if (current != nullptr || !create) {
+      return current;
+    }
+    T* fresh = new T[len]();
+    if (slot.compare_exchange_strong(current, fresh, std::memory_order_acq_rel)) {
+      return fresh;
+    }
+    delete[] fresh;
+    return current;
+  }
+
+  Page* GetPage(uint64_t label, bool create) {
+    uint64_t d = label / DirLabels;
+    if (d >= numDirs) {
+      throw std::out_of_range("Label " + std::to_string(label) + " exceeds bitmap capacity");
+    }
+    Directory* dir = LoadOrCreate(dirs[d], DirPages, create);
+    if (dir == nullptr) {
+      return nullptr;
+    }
+    return LoadOrCreate(dir[PageIdx(label)], PageWords, create);
+  }
+
+  template <typename F>
+  void ForEachPage(F&& f) const {
+    for (uint64_t d = 0; d < numDirs; d++) {
+      Directory* dir = dirs[d].load(std::memory_order_acquire);
+      if (dir == nullptr) {
+        continue;
+      }
+      for (uint64_t p = 0; p < DirPages; p++) {
+        Page* page = dir[p].load(std::memory_order_acquire);
+        if (page != nullptr) {
+          f(page);
+        }
+      }
+    }
+  }
+
+  uint64_t numDirs;
+  std::atomic<Directory*>* dirs;
+  std::atomic<uint64_t> count;
+};
@@ -119,6 +119,8 @@ uint32_t ConfigReader::Len(std::string key) const {
   return config_vars.at(key)->Len();
 }
 
+bool ConfigReader::Contains(std::string key) const { return config_vars.count(key) > 0; }
+
 void ConfigReader::PrintConfigVals() { LOG << this << std::endl; }
 
 std::ostream& operator<<(std::ostream& out, const ConfigReader& config) {
@@ -120,6 +120,8 @@ class ConfigReader {
 
   uint32_t Len(std::string key) const;
 
+  bool Contains(std::string key) const;
+
   const std::string& StrVal(std::string key, uint32_t index = 0) const;
 
   friend std::ostream& operator<<(std::ostream&, const ConfigReader& config);
@@ -1,10 +1,20 @@
 #include "DOPH.h"
 
+#include <omp.h>
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+#include "FixedConfigs.h"
+#include "Scratch.h"
+
 #define NULL_HASH ((uint32_t)-1)
 
 constexpr uint32_t ODD(uint32_t x) { return x << 31 ? x : x + 1; }
 
 template class DOPH<uint32_t, uint32_t>;
+template class DOPH<uint64_t, uint32_t>;
 
 template <typename Label_t, typename Hash_t>
 DOPH<Label_t, Hash_t>::DOPH(uint64_t _K, uint64_t _L, uint64_t _rangePow)
@@ -30,43 +40,227 @@ template <typename Label_t, typename Hash_t>
 Hash_t* DOPH<Label_t, Hash_t>::Hash(const SvmDataset<Label_t>& dataset, uint64_t offset,
                                     uint64_t num) {
   Hash_t* finalHashes = new Hash_t[num * L];
+  Hash(dataset.View(), offset, num, finalHashes);
+  return finalHashes;
+}
+
+/*
+ * Splits rows [offset, offset + num) into numChunks contiguous chunks of close to equal work,
+ * counting one unit per nonzero and rowCost per row, and writes the numChunks + 1 boundaries.
+ */
+static void BalanceChunks(const CsrView& batch, uint64_t offset, uint64_t num, uint64_t rowCost,
+                          uint64_t numChunks, uint64_t* chunks) {
+  auto work = [&](uint64_t row) {
+    return batch.markers[row] - batch.markers[offset] + (row - offset) * rowCost;
+  };
+  uint64_t total = work(offset + num);
+
+  chunks[0] = offset;
+  for (uint64_t c = 1; c < numChunks; c++) {
+    uint64_t target = total * c / numChunks;
+    uint64_t lo = chunks[c - 1], hi = offset + num;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (work(mid) < target) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    chunks[c] = lo;
+  }
+  chunks[numChunks] = offset + num;
+}
+
+template <typename Label_t, typename Hash_t>
+uint64_t DOPH<Label_t, Hash_t>::ScheduleChunks(const CsrView& batch, uint64_t offset, uint64_t num,
+                                               uint64_t*& chunks) {
+  uint64_t threads = omp_get_max_threads();
+  uint64_t numChunks = schedule == HashSchedule::Balanced ? threads * HashChunksPerThread : threads;
+  numChunks = std::max<uint64_t>(1, std::min(num, numChunks));
+  chunks = ThreadScratch<uint64_t, Scratch::HashChunks>(numChunks + 1).data();
+  if (schedule == HashSchedule::Balanced) {
+    // A row costs one pass over its nonzeros plus the initialization and densification of every
+    // bin, and the markers already hold the running nonzero count.
+    BalanceChunks(batch, offset, num, numHashes, numChunks, chunks);
+  } else {
+    for (uint64_t c = 0; c <= numChunks; c++) {
+      chunks[c] = offset + num * c / numChunks;
+    }
+  }
+  return numChunks;
+}
+
+template <typename Label_t, typename Hash_t>
+void DOPH<Label_t, Hash_t>::Hash(const CsrView& batch, uint64_t offset, uint64_t num,
+                                 Hash_t* finalHashes, uint64_t probes) {
+  if (fixedKernels) {
+#define SLASH_DOPH_KERNEL(FK, FL, FR, FS)                            \
+  if (K == FK && L == FL && rangePow == FR) {                        \
+    HashKernel<FK, FL, FR>(batch, offset, num, finalHashes, probes); \
+    return;                                                          \
+  }
+    SLASH_FIXED_CONFIGS(SLASH_DOPH_KERNEL)
+#undef SLASH_DOPH_KERNEL
+  }
+  HashKernel<0, 0, 0>(batch, offset, num, finalHashes, probes);
+}
+
+template <typename Label_t, typename Hash_t>
+template <uint64_t FixedK, uint64_t FixedL, uint64_t FixedRangePow>
+void DOPH<Label_t, Hash_t>::HashKernel(const CsrView& batch, uint64_t offset, uint64_t num,
+                                       Hash_t* finalHashes, uint64_t probes) {
+  const uint64_t K = FixedK ? FixedK : this->K;
+  const uint64_t L = FixedL ? FixedL : this->L;
+  const uint64_t rangePow = FixedRangePow ? FixedRangePow : this->rangePow;
+  const uint64_t numHashes = K * L;
+
+  uint64_t* chunks;
+  uint64_t numChunks = ScheduleChunks(batch, offset, num, chunks);
+  if (profiling) {
+    busySeconds.assign(omp_get_max_threads(), 0);
+  }
+
+#pragma omp parallel default(none) shared(batch, offset, num, finalHashes, probes, K, L, \
+                                          rangePow, numHashes, numChunks, chunks)
+  {
+    Hash_t* bins = ThreadScratch<Hash_t, Scratch::MinHashBins>(numHashes).data();
+    Hash_t* allHashes = ThreadScratch<Hash_t, Scratch::MinHashes>(numHashes).data();
+    Hash_t* secondBins = nullptr;
+    Hash_t* secondHashes = nullptr;
+    if (probes > 1) {
+      secondBins = ThreadScratch<Hash_t, Scratch::SecondMinHashBins>(numHashes).data();
+      secondHashes = ThreadScratch<Hash_t, Scratch::SecondMinHashes>(numHashes).data();
+    }
+    uint8_t* used = ThreadScratch<uint8_t, Scratch::ProbeComponents>(K).data();
+    Hash_t* indices = ThreadScratch<Hash_t, Scratch::TableIndices>(L).data();
+    auto start = std::chrono::steady_clock::now();
+
+#pragma omp for schedule(dynamic, 1) nowait
+    for (uint64_t c = 0; c < numChunks; c++) {
+      for (uint64_t n = chunks[c]; n < chunks[c + 1]; n++) {
+        ComputeMinHashes<FixedK * FixedL, FixedRangePow>(batch.Indices(n), batch.Len(n), bins,
+                                                         allHashes, secondBins, secondHashes);
 
-#pragma omp parallel for default(none) shared(dataset, offset, num, finalHashes)
-  for (uint64_t n = offset; n < offset + num; n++) {
-    uint32_t start = dataset.markers[n];
-    Hash_t* allHashes = ComputeMinHashes(dataset.indices + start, dataset.markers[n + 1] - start);
+        for (uint64_t tb = 0; tb < L; tb++) {
+          indices[tb] = 0;
+          for (uint64_t k = 0; k < K; k++) {
+            indices[tb] += Term(allHashes[K * tb + k], K * tb + k);
+          }
+        }
 
+        for (uint64_t tb = 0; tb < L; tb++) {
+          Hash_t index = indices[tb];
+          Hash_t next = indices[tb + 1 < L ? tb + 1 : 0];
+          Hash_t secondary = splitMask == 0 ? 0 : Secondary(next, rangePow) & splitMask;
+          Hash_t* out = finalHashes + ((n - offset) * L + tb) * probes;
+          out[0] = Bucket(index, rangePow) | secondary;
+
+          std::fill(used, used + K, false);
+          for (uint64_t p = 1; p < probes; p++) {
+            uint64_t best = K;
+            for (uint64_t k = 0; k < K; k++) {
+              uint64_t i = K * tb + k;
+              if (used[k] || secondHashes[i] == NULL_HASH) {
+                continue;
+              }
+              if (best == K || secondHashes[i] - allHashes[i] <
+                                   secondHashes[K * tb + best] - allHashes[K * tb + best]) {
+                best = k;
+              }
+            }
+            if (best == K) {
+              out[p] = out[0];
+              continue;
+            }
+            used[best] = true;
+            uint64_t i = K * tb + best;
+            out[p] = Bucket(index - Term(allHashes[i], i) + Term(secondHashes[i], i), rangePow) |
+                     secondary;
+          }
+        }
+      }
+    }
+
+    if (profiling) {
+      busySeconds[omp_get_thread_num()] =
+          std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+  }
+}
+
+template <typename Label_t, typename Hash_t>
+void DOPH<Label_t, Hash_t>::MinHashes(const CsrView& batch, uint64_t offset, uint64_t num,
+                                      Hash_t* minHashes) {
+  uint64_t* chunks;
+  uint64_t numChunks = ScheduleChunks(batch, offset, num, chunks);
+
+#pragma omp parallel default(none) shared(batch, offset, minHashes, numChunks, chunks)
+  {
+    Hash_t* bins = ThreadScratch<Hash_t, Scratch::MinHashBins>(numHashes).data();
+
+#pragma omp for schedule(dynamic, 1)
+    for (uint64_t c = 0; c < numChunks; c++) {
+      for (uint64_t n = chunks[c]; n < chunks[c + 1]; n++) {
+        ComputeMinHashes<0, 0>(batch.Indices(n), batch.Len(n), bins,
+                               minHashes + (n - offset) * numHashes);
+      }
+    }
+  }
+}
+
+template <typename Label_t, typename Hash_t>
+void DOPH<Label_t, Hash_t>::Combine(const Hash_t* minHashes, uint64_t num, uint64_t K, uint64_t L,
+                                    uint64_t rangePow, Hash_t* hashes) const {
+  if (K * L > numHashes || rangePow > this->rangePow) {
+    throw std::invalid_argument("Cannot derive K = " + std::to_string(K) + " L = " +
+                                std::to_string(L) + " range_pow = " + std::to_string(rangePow) +
+                                " from " + std::to_string(numHashes) + " min hashes of " +
+                                std::to_string(this->rangePow) + " bits");
+  }
+
+#pragma omp parallel for default(none) shared(minHashes, num, K, L, rangePow, hashes)
+  for (uint64_t n = 0; n < num; n++) {
+    const Hash_t* row = minHashes + n * numHashes;
     for (uint64_t tb = 0; tb < L; tb++) {
       Hash_t index = 0;
       for (uint64_t k = 0; k < K; k++) {
-        Hash_t h = allHashes[K * tb + k];
-        h *= randSeeds[K * tb + k];
-        h ^= h >> 13;
-        h ^= randSeeds[K * tb + k];
-        index += h * allHashes[K * tb + k];
+        index += Term(row[K * tb + k], K * tb + k);
       }
-      finalHashes[HashIdx(n - offset, tb)] = (index << 2) >> (32 - rangePow);
+      hashes[n * L + tb] = Bucket(index, rangePow);
     }
-    delete[] allHashes;
   }
-  return finalHashes;
 }
 
 template <typename Label_t, typename Hash_t>
-uint32_t DOPH<Label_t, Hash_t>::RandDoubleHash(uint32_t binid, uint32_t cnt) {
+uint32_t DOPH<Label_t, Hash_t>::RandDoubleHash(uint32_t binid, uint32_t cnt,
+                                               uint64_t logNumHashes) const {
   uint32_t val = ((binid + 1) << 10) + cnt;
   return (dhSeed * val << 3) >> (32 - logNumHashes);
 }
 
+constexpr uint64_t FloorLog2(uint64_t x) { return x > 1 ? 1 + FloorLog2(x >> 1) : 0; }
+
 template <typename Label_t, typename Hash_t>
-Hash_t* DOPH<Label_t, Hash_t>::ComputeMinHashes(uint32_t* nonzeros, uint32_t len) {
-  Hash_t* hashes = new Hash_t[numHashes];
+template <uint64_t FixedNumHashes, uint64_t FixedRangePow>
+void DOPH<Label_t, Hash_t>::ComputeMinHashes(const uint32_t* nonzeros, uint64_t len, Hash_t* hashes,
+                                             Hash_t* finalHashes, Hash_t* seconds,
+                                             Hash_t* finalSeconds) {
+  // With both fixed the bin width is a constant power of two and the division becomes a shift.
+  const uint64_t numHashes = FixedNumHashes ? FixedNumHashes : this->numHashes;
+  const uint64_t rangePow = FixedRangePow ? FixedRangePow : this->rangePow;
+  const uint64_t binsize =
+      FixedNumHashes && FixedRangePow ? (1ULL << FixedRangePow) / FixedNumHashes : this->binsize;
+  const uint64_t logNumHashes = FixedNumHashes ? FloorLog2(FixedNumHashes) : this->logNumHashes;
 
   for (uint64_t i = 0; i < numHashes; i++) {
     hashes[i] = NULL_HASH;
   }
+  if (seconds != nullptr) {
+    std::fill(seconds, seconds + numHashes, NULL_HASH);
+  }
 
-  for (uint32_t i = 0; i < len; i++) {
+  for (uint64_t i = 0; i < len; i++) {
     Hash_t h = nonzeros[i];
     h *= seed;
     h ^= h >> 13;
@@ -74,32 +268,33 @@ Hash_t* DOPH<Label_t, Hash_t>::ComputeMinHashes(uint32_t* nonzeros, uint32_t len
     Hash_t curhash = ((h * nonzeros[i]) << 5) >> (32 - rangePow);
     uint32_t binid = std::min<uint64_t>(curhash / binsize, numHashes - 1);
     if (curhash < hashes[binid]) {
+      if (seconds != nullptr) {
+        seconds[binid] = hashes[binid];
+      }
       hashes[binid] = curhash;
+    } else if (seconds != nullptr && curhash < seconds[binid] && curhash != hashes[binid]) {
+      seconds[binid] = curhash;
     }
   }
 
-  Hash_t* finalHashes = new Hash_t[numHashes];
-
   for (uint64_t bin = 0; bin < numHashes; bin++) {
     Hash_t next = hashes[bin];
-    if (next != NULL_HASH) {
-      finalHashes[bin] = next;
-      continue;
-    }
+    uint64_t source = bin;
     uint32_t cnt = 0;
     while (next == NULL_HASH) {
       cnt++;
-      uint32_t index = RandDoubleHash(bin, cnt);
-      next = hashes[index];
+      source = RandDoubleHash(bin, cnt, logNumHashes);
+      next = hashes[source];
       if (cnt > 100) {
         next = (Hash_t)-1;
         break;
       }
     }
     finalHashes[bin] = next;
+    if (seconds != nullptr) {
+      finalSeconds[bin] = cnt > 100 ? NULL_HASH : seconds[source];
+    }
   }
-  delete[] hashes;
-  return finalHashes;
 }
 
 template <typename Label_t, typename Hash_t>
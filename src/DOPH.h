@@ -1,27 +1,136 @@
 #pragma once
 
 #include <random>
+#include <vector>
 
 #include "DataLoader.h"
+#include "Hasher.h"
 
+// How DOPH::Hash divides the rows of a batch among threads.
+enum class HashSchedule {
+  Static,    // Equal numbers of rows per thread.
+  Balanced,  // Several chunks of close to equal nnz per thread, handed out dynamically.
+};
+
+// Number of work chunks per thread under HashSchedule::Balanced.
+constexpr uint64_t HashChunksPerThread = 8;
+
+/*
+ * Densified one permutation min hashing, for sparse vectors compared by the Jaccard similarity of
+ * their nonzero indices. Implements Hasher for Hash_t = uint32_t.
+ */
 template <typename Label_t, typename Hash_t>
-class DOPH {
+class DOPH : public Hasher {
  private:
   uint64_t K, L, numHashes, logNumHashes, rangePow, range, binsize;
+  Hash_t splitMask = 0;
 
   uint32_t* randSeeds;
   uint32_t seed, dhSeed;
 
-  constexpr uint64_t HashIdx(uint64_t i, uint64_t table) { return i * L + table; }
+  bool fixedKernels = true, profiling = false;
+  HashSchedule schedule = HashSchedule::Balanced;
+  std::vector<double> busySeconds;
+
+  // Contribution of min hash h at position i to the combined index of its table.
+  Hash_t Term(Hash_t h, uint64_t i) const {
+    Hash_t mixed = h * randSeeds[i];
+    mixed ^= mixed >> 13;
+    mixed ^= randSeeds[i];
+    return mixed * h;
+  }
+
+  static Hash_t Bucket(Hash_t index, uint64_t rangePow) { return (index << 2) >> (32 - rangePow); }
+
+  /*
+   * Bits above rangePow of the bucket ids of a table, taken from the combined min hashes of the
+   * next table, so that the members of a hot bucket are separated by min hashes they need not
+   * share even when they agree on all K of their own.
+   */
+  static Hash_t Secondary(Hash_t nextIndex, uint64_t rangePow) {
+    return rangePow < 32 ? (nextIndex * 0x9E3779B1U) >> rangePow << rangePow : 0;
+  }
 
-  uint32_t RandDoubleHash(uint32_t binid, uint32_t cnt);
+  uint32_t RandDoubleHash(uint32_t binid, uint32_t cnt, uint64_t logNumHashes) const;
 
-  Hash_t* ComputeMinHashes(uint32_t* nonzeros, uint32_t len);
+  /*
+   * Computes the densified one permutation min hashes of a vector. If secondHashes is not null
+   * it also receives, for each bin, the second smallest hash seen by the bin that supplied its
+   * min hash, or NULL_HASH if there was none. Non zero template arguments fix the number of
+   * hashes and the range at compile time, zero ones use the runtime values.
+   */
+  template <uint64_t FixedNumHashes, uint64_t FixedRangePow>
+  void ComputeMinHashes(const uint32_t* nonzeros, uint64_t len, Hash_t* bins, Hash_t* minHashes,
+                        Hash_t* secondBins = nullptr, Hash_t* secondHashes = nullptr);
+
+  /*
+   * Splits rows [offset, offset + num) into work chunks according to the schedule, returning the
+   * number of chunks and their boundaries in a per thread buffer.
+   */
+  uint64_t ScheduleChunks(const CsrView& batch, uint64_t offset, uint64_t num, uint64_t*& chunks);
+
+  // Body of Hash, specialised on K, L and rangePow in the same way as ComputeMinHashes.
+  template <uint64_t FixedK, uint64_t FixedL, uint64_t FixedRangePow>
+  void HashKernel(const CsrView& batch, uint64_t offset, uint64_t num, Hash_t* hashes,
+                  uint64_t probes);
 
  public:
   DOPH(uint64_t _K, uint64_t _L, uint64_t _rangePow);
 
   Hash_t* Hash(const SvmDataset<Label_t>& dataset, uint64_t offset, uint64_t num);
 
+  /*
+   * Writes probes bucket ids per table for each vector, laid out as [vector][table][probe].
+   * Probe 0 is the regular bucket. Each further probe replaces one of the table's K min hashes
+   * with the second smallest hash of its bin, taking the components whose min and second min
+   * are closest first since those are the most likely to flip for a near neighbour. Tables with
+   * fewer usable perturbations repeat probe 0. The SetSplitBits bits above rangePow hold the
+   * secondary hash, the same for every probe of a table. Configurations listed in
+   * SLASH_FIXED_CONFIGS run a kernel specialised for their K, L and rangePow.
+   */
+  void Hash(const CsrView& batch, uint64_t offset, uint64_t num, Hash_t* hashes,
+            uint64_t probes = 1) override;
+
+  uint64_t NumTables() const override { return L; }
+
+  uint64_t RangePow() const override { return rangePow; }
+
+  uint64_t SplitBits() const override { return 32 - rangePow; }
+
+  void SetSplitBits(uint64_t bits) override {
+    splitMask = bits == 0 ? 0 : (Hash_t)(((1ULL << bits) - 1) << rangePow);
+  }
+
+  uint64_t NumHashes() const { return numHashes; }
+
+  /*
+   * Writes the NumHashes() densified min hashes of each vector, so that several (K, L, rangePow)
+   * configurations can be derived from one pass over the data with Combine.
+   */
+  void MinHashes(const CsrView& batch, uint64_t offset, uint64_t num, Hash_t* minHashes);
+
+  /*
+   * Combines min hashes written by MinHashes into L bucket ids of rangePow bits per vector, with
+   * table t using min hashes [t * K, (t + 1) * K). The ids follow the same distribution as those
+   * of a DOPH built for (K, L, rangePow) but are not identical to them, since the min hashes come
+   * from NumHashes() rather than K * L bins. Requires K * L <= NumHashes() and rangePow no larger
+   * than that of this object.
+   */
+  void Combine(const Hash_t* minHashes, uint64_t num, uint64_t K, uint64_t L, uint64_t rangePow,
+               Hash_t* hashes) const;
+
+  // Disabling forces the generic kernel for every configuration, for benchmarking.
+  void SetFixedKernels(bool enabled) { fixedKernels = enabled; }
+
+  void SetSchedule(HashSchedule _schedule) { schedule = _schedule; }
+
+  /*
+   * While enabled, each call to Hash records the time every thread spends hashing, available
+   * from BusySeconds. Meant for benchmarks, it must not be enabled while Hash runs concurrently.
+   */
+  void SetProfiling(bool enabled) { profiling = enabled; }
+
+  const std::vector<double>& BusySeconds() const { return busySeconds; }
+
   ~DOPH();
 };
\ No newline at end of file
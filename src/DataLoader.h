@@ -1,21 +1,79 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "DistributedLog.h"
 
+// Smallest number of nonzeros SvmDataset storage grows by while reading a file.
+constexpr uint64_t GrowthNonzeros = 1 << 20;
+
+/*
+ * Non owning CSR view over a batch of sparse vectors. Row i occupies [markers[i], markers[i + 1])
+ * of indices and values.
+ */
+struct CsrView {
+  uint64_t len;
+  const uint32_t* indices;
+  const float* values;
+  const uint64_t* markers;
+
+  const uint32_t* Indices(uint64_t i) const { return indices + markers[i]; }
+
+  const float* Values(uint64_t i) const { return values + markers[i]; }
+
+  uint64_t Len(uint64_t i) const { return markers[i + 1] - markers[i]; }
+};
+
+/*
+ * Returns the number of nonzeros in each of the n lines of an SVM file that follow the first
+ * offset lines, without parsing or storing the vectors.
+ */
+inline std::vector<uint64_t> ReadSvmRowLengths(const std::string& filename, uint64_t n,
+                                               uint64_t offset = 0) {
+  std::ifstream file(filename);
+  std::string line;
+  std::vector<uint64_t> lengths;
+  lengths.reserve(n);
+
+  uint64_t totalLines = 0;
+  while (lengths.size() < n && std::getline(file, line)) {
+    if (totalLines++ < offset) {
+      continue;
+    }
+    lengths.push_back(std::count(line.begin(), line.end(), ':'));
+  }
+
+  if (lengths.size() < n) {
+    std::cout << "Only read " << lengths.size() << " out of " << n << " lines from file "
+              << filename << std::endl;
+    exit(1);
+  }
+  return lengths;
+}
+
+/*
+ * Nonzeros are stored contiguously in indices and values, so that a row is a single span and the
+ * whole dataset is one CsrView. When read from a file the storage starts from the avgDim hint,
+ * which may be 0, grows geometrically by at least GrowthNonzeros as rows are parsed, and is trimmed
+ * to the exact number of nonzeros once the file has been read.
+ */
 template <typename Label_t>
 class SvmDataset {
  private:
   bool sequentiallyLabeled;
 
-  static void ReadSvmDatasetHelper(const std::string& filename, SvmDataset& result, uint64_t n,
-                                   uint64_t offset = 0) {
+  static void ReadSvmDatasetHelper(std::istream& file, const std::string& filename,
+                                   SvmDataset& result, uint64_t n, uint64_t offset = 0) {
     auto start = std::chrono::high_resolution_clock::now();
-    std::ifstream file(filename);
     std::string line;
 
     uint64_t totalRead = 0;
@@ -37,6 +95,9 @@ class SvmDataset {
         long index = atol(item.substr(0, pos).c_str());
         float value = atof(item.substr(pos + 1).c_str());
 
+        if (totalDim == result.capacity) {
+          result.Reserve(std::max(2 * result.capacity, result.capacity + GrowthNonzeros));
+        }
         result.indices[totalDim] = index;
         result.values[totalDim] = value;
         totalDim++;
@@ -49,6 +110,7 @@ class SvmDataset {
       exit(1);
     }
     result.markers[totalRead] = totalDim;
+    result.Reserve(totalDim);
 
     auto end = std::chrono::high_resolution_clock::now();
 
@@ -58,10 +120,10 @@ class SvmDataset {
   }
 
  public:
-  uint64_t len;
+  uint64_t len, capacity;
   uint32_t* indices;
   float* values;
-  uint32_t* markers;
+  uint64_t* markers;
 
   union {
     Label_t* labels;
@@ -69,17 +131,51 @@ class SvmDataset {
   };
 
   SvmDataset(uint64_t _len, uint64_t avgDim, Label_t _start)
-      : sequentiallyLabeled(true), len(_len), start(_start) {
-    indices = new uint32_t[len * avgDim];
-    values = new float[len * avgDim];
-    markers = new uint32_t[len + 1];
+      : sequentiallyLabeled(true), len(_len), capacity(0), indices(nullptr), values(nullptr),
+        start(_start) {
+    Reserve(_len * avgDim);
+    markers = new uint64_t[len + 1];
   }
 
   SvmDataset(uint64_t _len, uint64_t avgDim, Label_t* _labels)
-      : sequentiallyLabeled(false), len(_len), labels(_labels) {
-    indices = new uint32_t[len * avgDim];
-    values = new float[len * avgDim];
-    markers = new uint32_t[len + 1];
+      : sequentiallyLabeled(false), len(_len), capacity(0), indices(nullptr), values(nullptr),
+        labels(_labels) {
+    Reserve(_len * avgDim);
+    markers = new uint64_t[len + 1];
+  }
+
+  SvmDataset(SvmDataset&& other)
+      : sequentiallyLabeled(other.sequentiallyLabeled),
+        len(other.len),
+        capacity(other.capacity),
+        indices(std::exchange(other.indices, nullptr)),
+        values(std::exchange(other.values, nullptr)),
+        markers(std::exchange(other.markers, nullptr)) {
+    if (sequentiallyLabeled) {
+      start = other.start;
+    } else {
+      labels = std::exchange(other.labels, nullptr);
+    }
+  }
+
+  /*
+   * Resizes indices and values to hold exactly nnz nonzeros, keeping the first min(nnz, capacity).
+   * Large blocks are remapped rather than copied by realloc, so growing and trimming do not need
+   * twice the memory of the data.
+   */
+  void Reserve(uint64_t nnz) {
+    uint64_t n = std::max<uint64_t>(nnz, 1);  // realloc of 0 bytes may free.
+    uint32_t* newIndices = (uint32_t*)realloc(indices, n * sizeof(uint32_t));
+    if (newIndices == nullptr) {
+      throw std::bad_alloc();
+    }
+    indices = newIndices;
+    float* newValues = (float*)realloc(values, n * sizeof(float));
+    if (newValues == nullptr) {
+      throw std::bad_alloc();
+    }
+    values = newValues;
+    capacity = nnz;
   }
 
   bool IsSequentiallyLabeled() const { return sequentiallyLabeled; }
@@ -90,17 +186,38 @@ class SvmDataset {
 
   uint64_t Len(uint64_t i) { return markers[i + 1] - markers[i]; }
 
+  CsrView View() const { return {len, indices, values, markers}; }
+
+  // Frees the values once nothing reads them, e.g. after they have been quantized.
+  void ReleaseValues() {
+    free(values);
+    values = nullptr;
+  }
+
   static SvmDataset ReadSvmDataset(const std::string& filename, Label_t* labels, uint64_t n,
                                    uint64_t avgDim, uint64_t offset = 0) {
     SvmDataset data(n, avgDim, labels);
-    ReadSvmDatasetHelper(filename, data, n, offset);
+    std::ifstream file(filename);
+    ReadSvmDatasetHelper(file, filename, data, n, offset);
     return data;
   }
 
   static SvmDataset ReadSvmDataset(const std::string& filename, Label_t start, uint64_t n,
                                    uint64_t avgDim, uint64_t offset = 0) {
     SvmDataset data(n, avgDim, start);
-    ReadSvmDatasetHelper(filename, data, n, offset);
+    std::ifstream file(filename);
+    ReadSvmDatasetHelper(file, filename, data, n, offset);
+    return data;
+  }
+
+  /*
+   * Reads the n rows that follow the next offset rows of an open SVM file, so that a file can be
+   * processed in chunks with one sequential pass. filename is only used in messages.
+   */
+  static SvmDataset ReadSvmDataset(std::istream& file, const std::string& filename, Label_t start,
+                                   uint64_t n, uint64_t avgDim, uint64_t offset = 0) {
+    SvmDataset data(n, avgDim, start);
+    ReadSvmDatasetHelper(file, filename, data, n, offset);
     return data;
   }
 
@@ -111,7 +228,7 @@ class SvmDataset {
       } else {
         std::cout << labels[i] << " ";
       }
-      for (uint32_t j = markers[i]; j < markers[i + 1]; j++) {
+      for (uint64_t j = markers[i]; j < markers[i + 1]; j++) {
         std::cout << indices[j] << ":" << values[j] << " ";
       }
       std::cout << std::endl;
@@ -119,8 +236,8 @@ class SvmDataset {
   }
 
   ~SvmDataset() {
-    delete[] indices;
-    delete[] values;
+    free(indices);
+    free(values);
     delete[] markers;
 
     if (!sequentiallyLabeled) {
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * (K, L, range_pow, reservoir_size) combinations that get compile time specialised DOPH and
+ * HashTable kernels, with every loop bound and stride a constant. Other combinations run the
+ * generic kernels. Each entry adds one instantiation of every kernel, so only list the
+ * configurations that are actually deployed.
+ */
+#define SLASH_FIXED_CONFIGS(X) \
+  X(8, 64, 18, 256)            \
+  X(4, 16, 12, 64)
+
+constexpr bool IsFixedConfig(uint64_t K, uint64_t L, uint64_t rangePow, uint64_t reservoirSize) {
+#define SLASH_MATCH_FIXED_CONFIG(FK, FL, FR, FS) \
+  if (K == FK && L == FL && rangePow == FR && reservoirSize == FS) return true;
+  SLASH_FIXED_CONFIGS(SLASH_MATCH_FIXED_CONFIG)
+#undef SLASH_MATCH_FIXED_CONFIG
+  return false;
+}
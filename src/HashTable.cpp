@@ -1,27 +1,57 @@
 #include "HashTable.h"
 
 #include <assert.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <iostream>
-#include <unordered_map>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "FixedConfigs.h"
+#include "Scratch.h"
+
+uint64_t BucketMajorBlockBytes() {
+  static const uint64_t bytes = [] {
+    long cache = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    cache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (cache <= 0) {
+      cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+#endif
+    return cache > 0 ? (uint64_t)cache / 2 : DefaultBucketMajorBlockBytes;
+  }();
+  return bytes;
+}
+
 template class HashTable<uint32_t, uint32_t>;
+template class HashTable<uint64_t, uint32_t>;
+
+template <typename Label_t, typename Hash_t>
+constexpr Label_t HashTable<Label_t, Hash_t>::EmptySlot;
 
 template <typename Label_t, typename Hash_t>
 HashTable<Label_t, Hash_t>::HashTable(uint64_t _numTables, uint64_t _reservoirSize,
-                                      uint64_t _rangePow, uint64_t _maxRand)
+                                      uint64_t _rangePow, uint64_t _maxRand, bool _concurrent)
     : numTables(_numTables),
       reservoirSize(_reservoirSize),
       rangePow(_rangePow),
-      range(1 << _rangePow),
-      maxRand(_maxRand) {
+      range(1ULL << _rangePow),
+      maxRand(_maxRand),
+      concurrent(_concurrent),
+      tombstones(MaxTombstoneLabels) {
   data = new Label_t[numTables * range * reservoirSize];
+  if (concurrent) {
+    uint64_t total = numTables * range * reservoirSize;
+#pragma omp parallel for default(none) shared(total)
+    for (uint64_t i = 0; i < total; i++) {
+      data[i] = EmptySlot;
+    }
+  }
   genRand = new uint32_t[maxRand];
 
-  mask = range - 1;
-
   srand(32);
   for (uint64_t i = 1; i < maxRand; i++) {
     genRand[i] = ((uint32_t)rand()) % (i + 1);
@@ -31,112 +61,739 @@ HashTable<Label_t, Hash_t>::HashTable(uint64_t _numTables, uint64_t _reservoirSi
 }
 
 template <typename Label_t, typename Hash_t>
-void HashTable<Label_t, Hash_t>::Insert(uint64_t n, Label_t* labels, Hash_t* hashes) {
-#pragma omp parallel for default(none) shared(n, labels, hashes)
-  for (uint64_t i = 0; i < n; i++) {
-    for (uint64_t table = 0; table < numTables; table++) {
-      Hash_t rowIndex = HashMod(hashes[HashIdx(i, table)]);
-      uint32_t counter = counters[CounterIdx(table, rowIndex)]++;
-
-      if (counter < reservoirSize) {
-        data[DataIdx(table, rowIndex, counter)] = labels[i];
-      } else {
-        counter = genRand[counter % maxRand];
-        if (counter < reservoirSize) {
-          data[DataIdx(table, rowIndex, counter)] = labels[i];
-        }
+template <typename Kernel>
+void HashTable<Label_t, Hash_t>::Dispatch(Kernel&& kernel) {
+  if (fixedKernels) {
+#define SLASH_TABLE_KERNEL(FK, FL, FR, FS)                            \
+  if (numTables == FL && rangePow == FR && reservoirSize == FS) {     \
+    kernel(TableShape<FL, FR, FS>{numTables, rangePow, reservoirSize}); \
+    return;                                                           \
+  }
+    SLASH_FIXED_CONFIGS(SLASH_TABLE_KERNEL)
+#undef SLASH_TABLE_KERNEL
+  }
+  kernel(TableShape<>{numTables, rangePow, reservoirSize});
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+void HashTable<Label_t, Hash_t>::InsertLabel(const Shape& shape, uint64_t table, Hash_t hash,
+                                             Label_t label) {
+  uint64_t bucket = shape.CounterIdx(table, hash & shape.Mask());
+  uint32_t state = splitBits > 0 ? counters[bucket].load(std::memory_order_relaxed) : 0;
+  uint32_t counter;
+  Label_t* slots;
+  uint8_t* slotTags = nullptr;
+  if (IsSplit(state)) {
+    uint64_t sub = ((state & ~SplitFlag) << splitBits) + SubBucket(hash);
+    counter = __atomic_fetch_add(&splitCounters[sub], 1, __ATOMIC_RELAXED);
+    slots = splitData.data() + sub * shape.Reservoir();
+    // A label admitted at the reservoir rate takes a free slot before it replaces any.
+    if (__atomic_load_n(&splitSizes[sub], __ATOMIC_RELAXED) < shape.Reservoir() &&
+        (counter < shape.Reservoir() || genRand[counter % maxRand] < shape.Reservoir())) {
+      uint32_t slot = __atomic_fetch_add(&splitSizes[sub], 1, __ATOMIC_RELAXED);
+      if (slot < shape.Reservoir()) {
+        __atomic_store_n(slots + slot, label, __ATOMIC_RELEASE);
+        return;
       }
     }
+  } else {
+    counter = counters[bucket].fetch_add(1, std::memory_order_relaxed);
+    slots = data + bucket * shape.Reservoir();
+    if (tags != nullptr) {
+      slotTags = tags + bucket * shape.Reservoir();
+    }
+    if (counter == hotThreshold) {
+      std::lock_guard<std::mutex> guard(hotLock);
+      hotBuckets.push_back(bucket);
+    }
+  }
+
+  if (counter >= shape.Reservoir()) {
+    counter = genRand[counter % maxRand];
+  }
+  if (counter < shape.Reservoir()) {
+    // Release store pairs with the acquire loads in GatherTable and BucketMajorKernel so a reader
+    // never sees a torn or unpublished slot. This is a plain store on x86.
+    __atomic_store_n(slots + counter, label, __ATOMIC_RELEASE);
+    if (slotTags != nullptr) {
+      slotTags[counter] = SubBucket(hash);
+    }
   }
 }
 
 template <typename Label_t, typename Hash_t>
-void HashTable<Label_t, Hash_t>::Insert(uint64_t n, Label_t start, Hash_t* hashes) {
-#pragma omp parallel for default(none) shared(n, start, hashes)
+template <typename Shape>
+void HashTable<Label_t, Hash_t>::InsertKernel(const Shape& shape, uint64_t n, const Label_t* labels,
+                                              Label_t start, const Hash_t* hashes) {
+#pragma omp parallel for default(none) shared(shape, n, labels, start, hashes)
   for (uint64_t i = 0; i < n; i++) {
-    for (uint64_t table = 0; table < numTables; table++) {
-      Hash_t rowIndex = HashMod(hashes[HashIdx(i, table)]);
-      uint32_t counter = counters[CounterIdx(table, rowIndex)]++;
-
-      if (counter < reservoirSize) {
-        data[DataIdx(table, rowIndex, counter)] = start + i;
-      } else {
-        counter = genRand[counter % maxRand];
-        if (counter < reservoirSize) {
-          data[DataIdx(table, rowIndex, counter)] = start + i;
-        }
-      }
+    Label_t label = labels != nullptr ? labels[i] : start + i;
+    const Hash_t* rowHashes = hashes + i * shape.Tables();
+    for (uint64_t table = 0; table < shape.Tables(); table++) {
+      InsertLabel(shape, table, rowHashes[table], label);
     }
   }
 }
 
 template <typename Label_t, typename Hash_t>
-QueryResult<Label_t> HashTable<Label_t, Hash_t>::Query(uint64_t n, Hash_t* hashes, uint64_t k) {
-  QueryResult<Label_t> result(n, k);
-#pragma omp parallel for default(none) shared(n, hashes, k, result)
-  for (uint64_t query = 0; query < n; query++) {
-    std::unordered_map<Label_t, uint32_t> contents(reservoirSize * numTables);
-    for (uint64_t table = 0; table < numTables; table++) {
-      Hash_t rowIndex = HashMod(hashes[HashIdx(query, table)]);
-      uint32_t counter = counters[CounterIdx(table, rowIndex)];
+void HashTable<Label_t, Hash_t>::Insert(uint64_t n, const Label_t* labels,
+                                        const Hash_t* hashes) {
+  Dispatch([&](auto shape) { InsertKernel(shape, n, labels, 0, hashes); });
+  if (!hotBuckets.empty()) {
+    SplitHotBuckets();
+  }
+}
+
+template <typename Label_t, typename Hash_t>
+void HashTable<Label_t, Hash_t>::Insert(uint64_t n, Label_t start, const Hash_t* hashes) {
+  Dispatch([&](auto shape) { InsertKernel(shape, n, nullptr, start, hashes); });
+  if (!hotBuckets.empty()) {
+    SplitHotBuckets();
+  }
+}
+
+template <typename Label_t, typename Hash_t>
+void HashTable<Label_t, Hash_t>::EnableSplitting(uint64_t _splitBits, double hotFactor) {
+  if (concurrent) {
+    throw std::invalid_argument("Hot bucket splitting is not supported by concurrent tables");
+  }
+  if (_splitBits == 0 || _splitBits > MaxSplitBits || rangePow + _splitBits > 8 * sizeof(Hash_t)) {
+    throw std::invalid_argument("split_bits must be in [1, " + std::to_string(MaxSplitBits) +
+                                "] and fit in the hash above range_pow");
+  }
+  splitBits = _splitBits;
+  hotThreshold = std::max<uint64_t>(reservoirSize, hotFactor * reservoirSize);
+  if (tags == nullptr) {
+    tags = new uint8_t[numTables * range * reservoirSize]();
+  }
+}
+
+template <typename Label_t, typename Hash_t>
+void HashTable<Label_t, Hash_t>::SplitHotBuckets() {
+  uint64_t fanout = 1ULL << splitBits;
+  for (uint64_t bucket : hotBuckets) {
+    uint32_t count = counters[bucket];
+    if (IsSplit(count)) {
+      continue;
+    }
+    uint64_t group = splitCounters.size() >> splitBits;
+    splitData.resize(splitData.size() + fanout * reservoirSize, EmptySlot);
+    splitCounters.resize(splitCounters.size() + fanout, 0);
+    splitSizes.resize(splitSizes.size() + fanout, 0);
+
+    uint64_t size = std::min<uint64_t>(count, reservoirSize);
+    for (uint64_t i = 0; i < size; i++) {
+      uint64_t sub = (group << splitBits) + tags[bucket * reservoirSize + i];
+      splitData[sub * reservoirSize + splitSizes[sub]++] = data[bucket * reservoirSize + i];
+    }
+    // The sample is uniform, so a sub bucket holding m of its size labels stands for about
+    // count * m / size of the inserts, and later inserts are admitted at the rate of that count.
+    for (uint64_t sub = group << splitBits; sub < (group + 1) << splitBits; sub++) {
+      splitCounters[sub] = (uint64_t)count * splitSizes[sub] / size;
+    }
+    counters[bucket] = SplitFlag | group;
+    numSplit++;
+  }
+  hotBuckets.clear();
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+uint64_t HashTable<Label_t, Hash_t>::Route(const Shape& shape, uint64_t table, Hash_t hash) const {
+  uint64_t bucket = shape.CounterIdx(table, hash & shape.Mask());
+  if (splitBits == 0) {
+    return bucket;
+  }
+  uint32_t state = counters[bucket].load(std::memory_order_relaxed);
+  if (!IsSplit(state)) {
+    return bucket;
+  }
+  return shape.Tables() * shape.Range() + ((state & ~SplitFlag) << splitBits) + SubBucket(hash);
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+const Label_t* HashTable<Label_t, Hash_t>::RouteSlots(const Shape& shape, uint64_t route) const {
+  uint64_t buckets = shape.Tables() * shape.Range();
+  return route < buckets ? data + route * shape.Reservoir()
+                         : splitData.data() + (route - buckets) * shape.Reservoir();
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+uint64_t HashTable<Label_t, Hash_t>::RouteSize(const Shape& shape, uint64_t route) const {
+  uint64_t buckets = shape.Tables() * shape.Range();
+  uint32_t count = route < buckets ? counters[route].load(std::memory_order_acquire)
+                                   : __atomic_load_n(&splitSizes[route - buckets],
+                                                     __ATOMIC_ACQUIRE);
+  return std::min<uint64_t>(count, shape.Reservoir());
+}
 
-      for (uint64_t i = 0; i < std::min<uint64_t>(counter, reservoirSize); i++) {
-        contents[data[DataIdx(table, rowIndex, i)]]++;
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+void HashTable<Label_t, Hash_t>::GatherTable(const Shape& shape, const Hash_t* tableHashes,
+                                             uint64_t table, uint64_t probes, bool filterDeleted,
+                                             const LabelBitmap* filter,
+                                             std::vector<Label_t>& candidates) {
+  for (uint64_t probe = 0; probe < probes; probe++) {
+    uint64_t route = Route(shape, table, tableHashes[probe]);
+    if (std::find_if(tableHashes, tableHashes + probe, [&](Hash_t h) {
+          return Route(shape, table, h) == route;
+        }) != tableHashes + probe) {
+      continue;
+    }
+    uint64_t size = RouteSize(shape, route);
+
+    const Label_t* bucket = RouteSlots(shape, route);
+    if (!concurrent && !filterDeleted && filter == nullptr) {
+      candidates.insert(candidates.end(), bucket, bucket + size);
+      continue;
+    }
+    for (uint64_t i = 0; i < size; i++) {
+      Label_t label = __atomic_load_n(bucket + i, __ATOMIC_ACQUIRE);
+      if (label != EmptySlot &&
+          !(filterDeleted && tombstones.Test(label) && !IsUpdatedCopy(table, route, label)) &&
+          (filter == nullptr || filter->Test(label))) {
+        candidates.push_back(label);
       }
     }
+  }
+}
 
-    std::pair<Label_t, uint32_t>* pairs = new std::pair<Label_t, uint32_t>[contents.size()]();
-    uint64_t cnt = 0;
-    for (const auto& x : contents) {
-      pairs[cnt++] = x;  // std::move(x)?
+template <typename Label_t>
+static void CountCandidates(Label_t* candidates, uint64_t len,
+                            std::vector<std::pair<Label_t, uint32_t>>& counts) {
+  std::sort(candidates, candidates + len);
+
+  counts.clear();
+  for (uint64_t i = 0; i < len;) {
+    uint64_t j = i + 1;
+    while (j < len && candidates[j] == candidates[i]) {
+      j++;
     }
+    counts.emplace_back(candidates[i], j - i);
+    i = j;
+  }
+}
+
+template <typename Label_t>
+static void CountCandidates(std::vector<Label_t>& candidates,
+                            std::vector<std::pair<Label_t, uint32_t>>& counts) {
+  CountCandidates(candidates.data(), candidates.size(), counts);
+}
+
+// Highest count first, ties broken by the smaller label.
+template <typename Label_t>
+static bool ByCount(const std::pair<Label_t, uint32_t>& a, const std::pair<Label_t, uint32_t>& b) {
+  return a.second > b.second || (a.second == b.second && a.first < b.first);
+}
+
+template <typename Label_t>
+static uint64_t SelectTopK(std::vector<std::pair<Label_t, uint32_t>>& counts, uint64_t k,
+                           std::pair<Label_t, uint32_t>* out) {
+  uint64_t len = std::min<uint64_t>(k, counts.size());
+  std::partial_sort(counts.begin(), counts.begin() + len, counts.end(), ByCount<Label_t>);
+  std::copy(counts.begin(), counts.begin() + len, out);
+  return len;
+}
+
+/*
+ * A label occurs at most once per table, so if the k-th count leads the (k+1)-th by more than
+ * the number of unvisited tables the top k set cannot change. Reorders counts.
+ */
+template <typename Label_t>
+static bool TopKIsFinal(std::vector<std::pair<Label_t, uint32_t>>& counts, uint64_t k,
+                        uint64_t remainingTables) {
+  if (counts.size() <= k) {
+    return remainingTables == 0;
+  }
+  std::nth_element(counts.begin(), counts.begin() + k, counts.end(), ByCount<Label_t>);
+  uint32_t kth = std::min_element(counts.begin(), counts.begin() + k, [](auto& a, auto& b) {
+                   return a.second < b.second;
+                 })->second;
+  return kth > counts[k].second + remainingTables;
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+uint64_t HashTable<Label_t, Hash_t>::TopK(const Shape& shape, const Hash_t* queryHashes, uint64_t k,
+                                          uint64_t probes, const LabelBitmap* filter,
+                                          std::pair<Label_t, uint32_t>* out) {
+  // Candidates are counted by sorting a per thread buffer, so the hot path does not allocate.
+  auto& candidates = ThreadScratch<Label_t, Scratch::Candidates>();
+  auto& counts = ThreadScratch<std::pair<Label_t, uint32_t>, Scratch::CandidateCounts>();
+
+  // Tombstones are only consulted once something has been deleted.
+  bool filterDeleted = !tombstones.Empty();
+
+  candidates.clear();
+  for (uint64_t table = 0; table < shape.Tables(); table++) {
+    GatherTable(shape, queryHashes + table * probes, table, probes, filterDeleted, filter,
+                candidates);
+  }
 
-    std::sort(pairs, pairs + cnt, [](const auto& a, const auto& b) { return a.second > b.second; });
+  CountCandidates(candidates, counts);
+  return SelectTopK(counts, k, out);
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+uint64_t HashTable<Label_t, Hash_t>::AnytimeTopK(const Shape& shape, const Hash_t* queryHashes,
+                                                 uint64_t k, uint64_t probes, uint64_t tableBudget,
+                                                 std::chrono::steady_clock::time_point deadline,
+                                                 std::pair<Label_t, uint32_t>* out,
+                                                 uint64_t& tablesUsed) {
+  auto& candidates = ThreadScratch<Label_t, Scratch::Candidates>();
+  auto& counts = ThreadScratch<std::pair<Label_t, uint32_t>, Scratch::CandidateCounts>();
 
-    uint64_t len = std::min(k, cnt);
-    result.len(query) = len;
-    for (uint64_t i = 0; i < len; i++) {
-      result[query][i] = pairs[i].first;
+  bool filterDeleted = !tombstones.Empty();
+  uint64_t maxTables = std::max<uint64_t>(1, std::min(tableBudget, shape.Tables()));
+
+  candidates.clear();
+  uint64_t table = 0;
+  while (table < maxTables) {
+    GatherTable(shape, queryHashes + table * probes, table, probes, filterDeleted, nullptr,
+                candidates);
+    table++;
+    if (table == maxTables || std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+    if (table % StabilityCheckInterval == 0) {
+      CountCandidates(candidates, counts);
+      if (TopKIsFinal(counts, k, shape.Tables() - table)) {
+        break;
+      }
     }
-    delete[] pairs;
   }
+  tablesUsed = table;
 
+  CountCandidates(candidates, counts);
+  return SelectTopK(counts, k, out);
+}
+
+template <typename Label_t, typename Hash_t>
+QueryResult<Label_t> HashTable<Label_t, Hash_t>::Query(uint64_t n, const Hash_t* hashes,
+                                                       uint64_t k) {
+  QueryResult<Label_t> result;
+  Query(n, hashes, k, result);
   return result;
 }
 
+template <typename Label_t, typename Hash_t>
+void HashTable<Label_t, Hash_t>::Query(uint64_t n, const Hash_t* hashes, uint64_t k,
+                                       QueryResult<Label_t>& result, uint64_t probes,
+                                       const LabelBitmap* filter) {
+  std::shared_lock<std::shared_timed_mutex> guard(compactLock);
+  Dispatch([&](auto shape) { QueryKernel(shape, n, hashes, k, result, probes, filter); });
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+void HashTable<Label_t, Hash_t>::QueryKernel(const Shape& shape, uint64_t n, const Hash_t* hashes,
+                                             uint64_t k, QueryResult<Label_t>& result,
+                                             uint64_t probes, const LabelBitmap* filter) {
+  result.Reset(n, k);
+  if (UseBucketMajor(shape, n, probes)) {
+    BucketMajorKernel(shape, n, hashes, k, probes, filter,
+                      [&](uint64_t query, const std::pair<Label_t, uint32_t>* top, uint64_t len) {
+                        result.len(query) = len;
+                        for (uint64_t i = 0; i < len; i++) {
+                          result[query][i] = top[i].first;
+                        }
+                      });
+    return;
+  }
+#pragma omp parallel default(none) shared(shape, n, hashes, k, result, probes, filter)
+  {
+    auto* top = ThreadScratch<std::pair<Label_t, uint32_t>, Scratch::TopK>(k).data();
+
+#pragma omp for
+    for (uint64_t query = 0; query < n; query++) {
+      uint64_t len =
+          TopK(shape, hashes + query * shape.Tables() * probes, k, probes, filter, top);
+      result.len(query) = len;
+      for (uint64_t i = 0; i < len; i++) {
+        result[query][i] = top[i].first;
+      }
+    }
+  }
+}
+
+template <typename Label_t, typename Hash_t>
+void HashTable<Label_t, Hash_t>::QueryAnytime(uint64_t n, const Hash_t* hashes, uint64_t k,
+                                              uint64_t tableBudget,
+                                              std::chrono::steady_clock::time_point deadline,
+                                              QueryResult<Label_t>& result, uint64_t* tablesUsed,
+                                              uint64_t probes) {
+  std::shared_lock<std::shared_timed_mutex> guard(compactLock);
+  Dispatch([&](auto shape) {
+    QueryAnytimeKernel(shape, n, hashes, k, tableBudget, deadline, result, tablesUsed, probes);
+  });
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+void HashTable<Label_t, Hash_t>::QueryAnytimeKernel(
+    const Shape& shape, uint64_t n, const Hash_t* hashes, uint64_t k, uint64_t tableBudget,
+    std::chrono::steady_clock::time_point deadline, QueryResult<Label_t>& result,
+    uint64_t* tablesUsed, uint64_t probes) {
+  result.Reset(n, k);
+#pragma omp parallel default(none) \
+    shared(shape, n, hashes, k, tableBudget, deadline, result, tablesUsed, probes)
+  {
+    auto* top = ThreadScratch<std::pair<Label_t, uint32_t>, Scratch::TopK>(k).data();
+
+#pragma omp for
+    for (uint64_t query = 0; query < n; query++) {
+      uint64_t len = AnytimeTopK(shape, hashes + query * shape.Tables() * probes, k, probes,
+                                 tableBudget, deadline, top, tablesUsed[query]);
+      result.len(query) = len;
+      for (uint64_t i = 0; i < len; i++) {
+        result[query][i] = top[i].first;
+      }
+    }
+  }
+}
+
 template <typename Label_t, typename Hash_t>
 QueryResult<std::pair<Label_t, uint32_t>> HashTable<Label_t, Hash_t>::QueryWithCounts(
-    uint64_t n, Hash_t* hashes, uint64_t k) {
-  QueryResult<std::pair<Label_t, uint32_t>> result(n, k);
-#pragma omp parallel for default(none) shared(n, hashes, k, result)
+    uint64_t n, const Hash_t* hashes, uint64_t k) {
+  QueryResult<std::pair<Label_t, uint32_t>> result;
+  QueryWithCounts(n, hashes, k, result);
+  return result;
+}
+
+template <typename Label_t, typename Hash_t>
+void HashTable<Label_t, Hash_t>::QueryWithCounts(
+    uint64_t n, const Hash_t* hashes, uint64_t k,
+    QueryResult<std::pair<Label_t, uint32_t>>& result, uint64_t probes,
+    const LabelBitmap* filter) {
+  std::shared_lock<std::shared_timed_mutex> guard(compactLock);
+  Dispatch(
+      [&](auto shape) { QueryWithCountsKernel(shape, n, hashes, k, result, probes, filter); });
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+void HashTable<Label_t, Hash_t>::QueryWithCountsKernel(
+    const Shape& shape, uint64_t n, const Hash_t* hashes, uint64_t k,
+    QueryResult<std::pair<Label_t, uint32_t>>& result, uint64_t probes,
+    const LabelBitmap* filter) {
+  result.Reset(n, k);
+  if (UseBucketMajor(shape, n, probes)) {
+    BucketMajorKernel(shape, n, hashes, k, probes, filter,
+                      [&](uint64_t query, const std::pair<Label_t, uint32_t>* top, uint64_t len) {
+                        result.len(query) = len;
+                        std::copy(top, top + len, result[query]);
+                      });
+    return;
+  }
+#pragma omp parallel for default(none) shared(shape, n, hashes, k, result, probes, filter)
   for (uint64_t query = 0; query < n; query++) {
-    std::unordered_map<Label_t, uint32_t> contents(reservoirSize * numTables);
+    result.len(query) =
+        TopK(shape, hashes + query * shape.Tables() * probes, k, probes, filter, result[query]);
+  }
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+uint64_t HashTable<Label_t, Hash_t>::BucketMajorBlock(const Shape& shape, uint64_t probes) const {
+  uint64_t queryBytes = shape.Tables() * probes * shape.Reservoir() * sizeof(Label_t);
+  return std::max<uint64_t>(1, BucketMajorBlockBytes() / queryBytes);
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape>
+bool HashTable<Label_t, Hash_t>::UseBucketMajor(const Shape& shape, uint64_t n,
+                                                uint64_t probes) const {
+  if (queryOrder != QueryOrder::Auto) {
+    return queryOrder == QueryOrder::BucketMajor;
+  }
+  uint64_t tableBytes = shape.Tables() * shape.Range() * shape.Reservoir() * sizeof(Label_t);
+  // The batch probes n * probes buckets of the Range() in each table. The block only bounds the
+  // candidate memory, so it does not enter the decision.
+  return tableBytes > CachedTableBytes && n * probes > shape.Range();
+}
+
+template <typename Label_t, typename Hash_t>
+bool HashTable<Label_t, Hash_t>::PrefersBucketMajor(uint64_t n, uint64_t probes) {
+  bool prefers = false;
+  Dispatch([&](auto shape) { prefers = UseBucketMajor(shape, n, probes); });
+  return prefers;
+}
+
+template <typename Label_t, typename Hash_t>
+template <typename Shape, typename Emit>
+void HashTable<Label_t, Hash_t>::BucketMajorKernel(const Shape& shape, uint64_t n,
+                                                   const Hash_t* hashes, uint64_t k,
+                                                   uint64_t probes, const LabelBitmap* filter,
+                                                   Emit&& emit) {
+  uint64_t numTables = shape.Tables(), visitsPerQuery = numTables * probes;
+  uint64_t block = std::min(n, BucketMajorBlock(shape, probes));
+  bool filterDeleted = !tombstones.Empty();
+  bool checkSlots = concurrent || filterDeleted || filter != nullptr;
+
+  // Reused across blocks and calls, the candidates being bounded by BucketMajorBlockBytes.
+  Visit* visits = ThreadScratch<Visit, Scratch::BlockVisits>(block * visitsPerQuery).data();
+  uint64_t* starts = ThreadScratch<uint64_t, Scratch::BlockStarts>(block + 1).data();
+
+  for (uint64_t first = 0; first < n; first += block) {
+    uint64_t cnt = std::min(block, n - first);
+    uint64_t tableVisits = cnt * probes;
+
+    // Visits are grouped by table, and a probe repeating an earlier route of its query reads
+    // nothing, as in GatherTable.
+#pragma omp parallel for default(none) \
+    shared(shape, hashes, probes, numTables, visitsPerQuery, first, cnt, tableVisits, visits, \
+           starts)
+    for (uint64_t q = 0; q < cnt; q++) {
+      const Hash_t* queryHashes = hashes + (first + q) * visitsPerQuery;
+      uint64_t offset = 0;
+      for (uint64_t table = 0; table < numTables; table++) {
+        const Hash_t* tableHashes = queryHashes + table * probes;
+        for (uint64_t probe = 0; probe < probes; probe++) {
+          uint64_t route = Route(shape, table, tableHashes[probe]);
+          bool repeated = std::any_of(tableHashes, tableHashes + probe,
+                                      [&](Hash_t h) { return Route(shape, table, h) == route; });
+          uint32_t size = repeated ? 0 : RouteSize(shape, route);
+          visits[table * tableVisits + q * probes + probe] = {route, (uint32_t)q, size, offset};
+          offset += size;
+        }
+      }
+      starts[q + 1] = offset;
+    }
+    starts[0] = 0;
+    for (uint64_t q = 0; q < cnt; q++) {
+      starts[q + 1] += starts[q];
+    }
+    Label_t* candidates = ThreadScratch<Label_t, Scratch::BlockCandidates>(starts[cnt]).data();
+
+    // Each table streams its probed buckets in route order, reading every bucket once.
+#pragma omp parallel for default(none) schedule(dynamic, 1)                                 \
+    shared(shape, filter, numTables, tableVisits, filterDeleted, checkSlots, visits, starts, \
+           candidates)
     for (uint64_t table = 0; table < numTables; table++) {
-      Hash_t rowIndex = HashMod(hashes[HashIdx(query, table)]);
-      uint32_t counter = counters[CounterIdx(table, rowIndex)];
+      Visit* begin = visits + table * tableVisits;
+      Visit* end = begin + tableVisits;
+      std::sort(begin, end, [](const Visit& a, const Visit& b) { return a.route < b.route; });
+
+      Label_t* loaded = ThreadScratch<Label_t, Scratch::BucketSlots>(shape.Reservoir()).data();
+      for (Visit* run = begin; run < end;) {
+        Visit* runEnd = run;
+        uint32_t size = 0;
+        while (runEnd < end && runEnd->route == run->route) {
+          size = std::max(size, runEnd->size);
+          runEnd++;
+        }
 
-      for (uint64_t i = 0; i < std::min<uint64_t>(counter, reservoirSize); i++) {
-        contents[data[DataIdx(table, rowIndex, i)]]++;
+        const Label_t* slots = RouteSlots(shape, run->route);
+        if (checkSlots) {
+          // Rejected slots become EmptySlot, which sorts after every label and is dropped.
+          for (uint32_t i = 0; i < size; i++) {
+            Label_t label = __atomic_load_n(slots + i, __ATOMIC_ACQUIRE);
+            bool keep =
+                label != EmptySlot &&
+                !(filterDeleted && tombstones.Test(label) &&
+                  !IsUpdatedCopy(table, run->route, label)) &&
+                (filter == nullptr || filter->Test(label));
+            loaded[i] = keep ? label : EmptySlot;
+          }
+          slots = loaded;
+        }
+        for (Visit* visit = run; visit < runEnd; visit++) {
+          std::copy(slots, slots + visit->size, candidates + starts[visit->query] + visit->offset);
+        }
+        run = runEnd;
       }
     }
 
-    std::pair<Label_t, uint32_t>* pairs = new std::pair<Label_t, uint32_t>[contents.size()]();
-    uint64_t cnt = 0;
-    for (const auto& x : contents) {
-      pairs[cnt++] = x;  // std::move(x)?
+#pragma omp parallel default(none) shared(k, first, cnt, starts, candidates, emit)
+    {
+      auto& counts = ThreadScratch<std::pair<Label_t, uint32_t>, Scratch::CandidateCounts>();
+      auto* top = ThreadScratch<std::pair<Label_t, uint32_t>, Scratch::TopK>(k).data();
+
+#pragma omp for schedule(dynamic, 64)
+      for (uint64_t q = 0; q < cnt; q++) {
+        Label_t* queryCandidates = candidates + starts[q];
+        uint64_t len = starts[q + 1] - starts[q];
+        CountCandidates(queryCandidates, len, counts);
+        if (!counts.empty() && counts.back().first == EmptySlot) {
+          counts.pop_back();
+        }
+        emit(first + q, top, SelectTopK(counts, k, top));
+      }
     }
+  }
+}
 
-    std::sort(pairs, pairs + cnt, [](const auto& a, const auto& b) { return a.second > b.second; });
+template <typename Label_t, typename Hash_t>
+void HashTable<Label_t, Hash_t>::Delete(uint64_t n, const Label_t* labels) {
+  for (uint64_t i = 0; i < n; i++) {
+    tombstones.Set(labels[i]);
+  }
+  // A deleted label loses the copies an earlier update made live.
+  if (!updated.empty()) {
+    std::unique_lock<std::shared_timed_mutex> guard(compactLock);
+    for (uint64_t i = 0; i < n; i++) {
+      updated.erase(labels[i]);
+    }
+  }
+}
 
-    uint64_t len = std::min(k, cnt);
-    result.len(query) = len;
-    for (uint64_t i = 0; i < len; i++) {
-      result[query][i] = pairs[i];
+template <typename Label_t, typename Hash_t>
+bool HashTable<Label_t, Hash_t>::IsUpdatedCopy(uint64_t table, uint64_t route,
+                                               Label_t label) const {
+  if (updated.empty()) {
+    return false;
+  }
+  auto it = updated.find(label);
+  if (it == updated.end()) {
+    return false;
+  }
+  TableShape<> shape{numTables, rangePow, reservoirSize};
+  uint64_t first = table < numTables ? table : 0, last = table < numTables ? table + 1 : numTables;
+  for (uint64_t t = first; t < last; t++) {
+    if (Route(shape, t, it->second[t]) == route) {
+      return true;
     }
-    delete[] pairs;
   }
+  return false;
+}
 
-  return result;
+template <typename Label_t, typename Hash_t>
+void HashTable<Label_t, Hash_t>::Update(uint64_t n, const Label_t* labels, const Hash_t* hashes) {
+  // Exclusive, since queries read updated. Costs O(n L reservoirSize), independent of the index.
+  std::unique_lock<std::shared_timed_mutex> guard(compactLock);
+  TableShape<> shape{numTables, rangePow, reservoirSize};
+  for (uint64_t i = 0; i < n; i++) {
+    Label_t label = labels[i];
+    const Hash_t* rowHashes = hashes + i * numTables;
+    tombstones.Set(label);
+    updated[label].assign(rowHashes, rowHashes + numTables);
+    for (uint64_t table = 0; table < numTables; table++) {
+      uint64_t route = Route(shape, table, rowHashes[table]);
+      const Label_t* slots = RouteSlots(shape, route);
+      const Label_t* end = slots + RouteSize(shape, route);
+      if (std::find(slots, end, label) == end) {
+        InsertLabel(shape, table, rowHashes[table], label);
+      }
+    }
+  }
+  if (!hotBuckets.empty()) {
+    SplitHotBuckets();
+  }
+}
+
+template <typename Label_t, typename Hash_t>
+uint64_t HashTable<Label_t, Hash_t>::Compact(double minDeadFraction) {
+  if (tombstones.Empty()) {
+    return 0;
+  }
+
+  std::unique_lock<std::shared_timed_mutex> guard(compactLock);
+  uint64_t reclaimed = 0;
+#pragma omp parallel for default(none) shared(minDeadFraction) reduction(+ : reclaimed)
+  for (uint64_t bucket = 0; bucket < numTables * range; bucket++) {
+    if (IsSplit(counters[bucket])) {
+      continue;
+    }
+    uint64_t size = std::min<uint64_t>(counters[bucket], reservoirSize);
+    uint8_t* slotTags = tags != nullptr ? tags + bucket * reservoirSize : nullptr;
+    uint64_t live = CompactSlots(data + bucket * reservoirSize, slotTags, size, minDeadFraction,
+                                 bucket / range, bucket);
+    if (live < size) {
+      counters[bucket].store(live, std::memory_order_release);
+      reclaimed += size - live;
+    }
+  }
+
+#pragma omp parallel for default(none) shared(minDeadFraction) reduction(+ : reclaimed)
+  for (uint64_t sub = 0; sub < splitCounters.size(); sub++) {
+    uint64_t size = std::min<uint64_t>(splitSizes[sub], reservoirSize);
+    uint64_t live = CompactSlots(splitData.data() + sub * reservoirSize, nullptr, size,
+                                 minDeadFraction, numTables, numTables * range + sub);
+    if (live < size) {
+      splitCounters[sub] = live;
+      splitSizes[sub] = live;
+      reclaimed += size - live;
+    }
+  }
+
+  // Every stale copy is gone, so the live copies of updates need no exceptions either.
+  if (minDeadFraction <= 0) {
+    tombstones.ClearAll();
+    updated.clear();
+  }
+
+  return reclaimed;
+}
+
+template <typename Label_t, typename Hash_t>
+uint64_t HashTable<Label_t, Hash_t>::CompactSlots(Label_t* slots, uint8_t* slotTags, uint64_t size,
+                                                  double minDeadFraction, uint64_t table,
+                                                  uint64_t route) {
+  auto isDead = [&](Label_t label) {
+    return tombstones.Test(label) && !IsUpdatedCopy(table, route, label);
+  };
+  uint64_t dead = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    dead += isDead(slots[i]);
+  }
+  if (dead == 0 || dead < minDeadFraction * size) {
+    return size;
+  }
+
+  uint64_t live = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    if (!isDead(slots[i])) {
+      if (slotTags != nullptr) {
+        slotTags[live] = slotTags[i];
+      }
+      slots[live++] = slots[i];
+    }
+  }
+  // Queries are excluded, but the stale copies behind the new counter are cleared regardless.
+  std::fill(slots + live, slots + size, EmptySlot);
+  return live;
+}
+
+template <typename Label_t, typename Hash_t>
+uint64_t HashTable<Label_t, Hash_t>::ScanSize(uint64_t n, const Hash_t* hashes, uint64_t probes,
+                                              QueryOrder order) {
+  std::shared_lock<std::shared_timed_mutex> guard(compactLock);
+  uint64_t total = 0;
+  TableShape<> shape{numTables, rangePow, reservoirSize};
+  if (order == QueryOrder::BucketMajor) {
+    uint64_t block = BucketMajorBlock(shape, probes);
+    std::vector<uint64_t> routes;
+    for (uint64_t first = 0; first < n; first += block) {
+      routes.clear();
+      uint64_t end = std::min(n, first + block) * numTables * probes;
+      for (uint64_t i = first * numTables * probes; i < end; i++) {
+        routes.push_back(Route(shape, i / probes % numTables, hashes[i]));
+      }
+      std::sort(routes.begin(), routes.end());
+      routes.erase(std::unique(routes.begin(), routes.end()), routes.end());
+      for (uint64_t route : routes) {
+        total += RouteSize(shape, route);
+      }
+    }
+    return total;
+  }
+  for (uint64_t query = 0; query < n; query++) {
+    for (uint64_t table = 0; table < numTables; table++) {
+      const Hash_t* tableHashes = hashes + (query * numTables + table) * probes;
+      for (uint64_t probe = 0; probe < probes; probe++) {
+        uint64_t route = Route(shape, table, tableHashes[probe]);
+        if (std::none_of(tableHashes, tableHashes + probe,
+                         [&](Hash_t h) { return Route(shape, table, h) == route; })) {
+          total += RouteSize(shape, route);
+        }
+      }
+    }
+  }
+  return total;
 }
 
 template <typename Label_t, typename Hash_t>
@@ -145,9 +802,15 @@ void HashTable<Label_t, Hash_t>::Dump() {
     std::cout << "Table: " << table << std::endl;
     for (uint64_t row = 0; row < range; row++) {
       uint32_t cnt = counters[CounterIdx(table, row)];
+      if (IsSplit(cnt)) {
+        std::cout << "[ " << row << " :: split ]" << std::endl;
+        continue;
+      }
       std::cout << "[ " << row << " :: " << cnt << " ]";
       for (uint64_t i = 0; i < std::min<uint64_t>(cnt, reservoirSize); i++) {
-        std::cout << "\t" << data[DataIdx(table, row, i)];
+        if (data[DataIdx(table, row, i)] != EmptySlot) {
+          std::cout << "\t" << data[DataIdx(table, row, i)];
+        }
       }
       std::cout << std::endl;
     }
@@ -160,4 +823,5 @@ HashTable<Label_t, Hash_t>::~HashTable() {
   delete[] data;
   delete[] counters;
   delete[] genRand;
+  delete[] tags;
 }
@@ -1,72 +1,412 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
 #include <utility>
+#include <vector>
+
+#include "Bitmap.h"
 
 constexpr uint64_t DefaultMaxRand = 10000;
 
+// Number of tables an anytime query visits between checks of whether its top k is final.
+constexpr uint64_t StabilityCheckInterval = 4;
+
+// Largest number of hash bits that can select the sub bucket of a split bucket.
+constexpr uint64_t MaxSplitBits = 8;
+
+// Multiple of the reservoir size a bucket must receive before it is split, unless configured.
+constexpr double DefaultHotFactor = 8;
+
+/*
+ * Upper bound on the candidate labels a bucket major block gathers: half of the last level cache,
+ * so that the labels scattered into the block by the bucket scan are still cached when each query
+ * counts its own. DefaultBucketMajorBlockBytes where the cache size cannot be read.
+ */
+uint64_t BucketMajorBlockBytes();
+
+constexpr uint64_t DefaultBucketMajorBlockBytes = 8ULL << 20;
+
+// Slot bytes up to which the tables are assumed to stay in cache, so query major reads are cheap.
+constexpr uint64_t CachedTableBytes = 32ULL << 20;
+
+/*
+ * How Query and QueryWithCounts walk the buckets of a batch. Query major scans the buckets of
+ * each query in turn, so a bucket probed by many queries of the batch is read once per query.
+ * Bucket major sorts the probes of a block of queries by bucket and reads each bucket once,
+ * copying its labels to every query that probes it. Auto picks bucket major when the tables are
+ * too large to stay in cache and the batch makes more probes per table than there are buckets in
+ * it, so the average bucket is probed more than once.
+ */
+enum class QueryOrder { Auto, QueryMajor, BucketMajor };
+
 template <typename Label_t>
 class QueryResult {
  private:
   Label_t* results;
   uint64_t* lens;
-  uint64_t n, k;
+  uint64_t n, k, capacity, lensCapacity;
 
  public:
-  QueryResult(uint64_t _n, uint64_t _k) : n(_n), k(_k) {
+  QueryResult() : results(nullptr), lens(nullptr), n(0), k(0), capacity(0), lensCapacity(0) {}
+
+  QueryResult(uint64_t _n, uint64_t _k) : n(_n), k(_k), capacity(_n * _k), lensCapacity(_n) {
     results = new Label_t[n * k]();
     lens = new uint64_t[n]();
   }
 
   QueryResult(const QueryResult& other) = delete;
   QueryResult& operator=(const QueryResult& other) = delete;
-  QueryResult(QueryResult&& other) = default;
-  QueryResult& operator=(QueryResult&& other) = default;
+
+  QueryResult(QueryResult&& other)
+      : results(std::exchange(other.results, nullptr)),
+        lens(std::exchange(other.lens, nullptr)),
+        n(std::exchange(other.n, 0)),
+        k(std::exchange(other.k, 0)),
+        capacity(std::exchange(other.capacity, 0)),
+        lensCapacity(std::exchange(other.lensCapacity, 0)) {}
+
+  QueryResult& operator=(QueryResult&& other) {
+    std::swap(results, other.results);
+    std::swap(lens, other.lens);
+    std::swap(n, other.n);
+    std::swap(k, other.k);
+    std::swap(capacity, other.capacity);
+    std::swap(lensCapacity, other.lensCapacity);
+    return *this;
+  }
+
+  /*
+   * Reshapes the result to hold n rows of k results, only reallocating when the existing buffers
+   * are too small, so that a result can be reused across batches without allocating.
+   */
+  void Reset(uint64_t _n, uint64_t _k) {
+    n = _n;
+    k = _k;
+    if (n * k > capacity) {
+      delete[] results;
+      capacity = n * k;
+      results = new Label_t[capacity];
+    }
+    if (n > lensCapacity) {
+      delete[] lens;
+      lensCapacity = n;
+      lens = new uint64_t[lensCapacity];
+    }
+    std::fill(lens, lens + n, 0);
+  }
 
   uint64_t len() const { return n; }
 
+  uint64_t topk() const { return k; }
+
   uint64_t& len(uint64_t i) { return lens[i]; }
 
+  uint64_t len(uint64_t i) const { return lens[i]; }
+
   Label_t* operator[](uint64_t i) { return results + i * k; }
 
+  const Label_t* operator[](uint64_t i) const { return results + i * k; }
+
   ~QueryResult() {
     delete[] results;
     delete[] lens;
   }
 };
 
+/*
+ * Dimensions of a HashTable as seen by its insert and query kernels. A non zero template argument
+ * fixes that dimension at compile time so the kernel gets constant loop bounds and strides, while
+ * a zero one reads the runtime value.
+ */
+template <uint64_t FixedTables = 0, uint64_t FixedRangePow = 0, uint64_t FixedReservoir = 0>
+struct TableShape {
+  uint64_t numTables, rangePow, reservoirSize;
+
+  constexpr uint64_t Tables() const { return FixedTables ? FixedTables : numTables; }
+
+  constexpr uint64_t Range() const { return 1ULL << (FixedRangePow ? FixedRangePow : rangePow); }
+
+  constexpr uint64_t Reservoir() const { return FixedReservoir ? FixedReservoir : reservoirSize; }
+
+  constexpr uint64_t Mask() const { return Range() - 1; }
+
+  constexpr uint64_t CounterIdx(uint64_t table, uint64_t row) const {
+    return table * Range() + row;
+  }
+
+  constexpr uint64_t DataIdx(uint64_t table, uint64_t row, uint64_t offset) const {
+    return CounterIdx(table, row) * Reservoir() + offset;
+  }
+};
+
 template <typename Label_t, typename Hash_t>
 class HashTable {
  private:
   uint64_t numTables, reservoirSize, rangePow, range, maxRand;
-  Hash_t mask;
+  bool concurrent, fixedKernels = true;
+  QueryOrder queryOrder = QueryOrder::Auto;
 
   Label_t* data;
   std::atomic<uint32_t>* counters;
 
   uint32_t* genRand;
 
+  /*
+   * Labels at or above this limit cannot be deleted. 2^40 covers the full 32-bit label space and
+   * keeps the top level of the tombstone bitmap small for 64-bit labels.
+   */
+  static constexpr uint64_t MaxTombstoneLabels =
+      sizeof(Label_t) < sizeof(uint64_t) ? 1ULL << (8 * sizeof(Label_t)) : 1ULL << 40;
+
+  LabelBitmap tombstones;
+
+  // Held shared by every query and exclusively by Compact, which moves labels within buckets.
+  std::shared_timed_mutex compactLock;
+
+  /*
+   * New hashes of the labels moved by Update. Their old copies stay tombstoned until compacted,
+   * while a copy in the bucket its new hash routes to in that table is live.
+   */
+  std::unordered_map<Label_t, std::vector<Hash_t>> updated;
+
+  /*
+   * Whether a tombstoned label found in route is the live copy of an update, checking only
+   * table, or every table when table is numTables as for sub buckets.
+   */
+  bool IsUpdatedCopy(uint64_t table, uint64_t route, Label_t label) const;
+
+  /*
+   * Hot bucket splitting, see EnableSplitting. The counter of a split bucket holds SplitFlag and
+   * the index of its group of 2^splitBits sub buckets, whose slots and counters are in splitData
+   * and splitCounters. A sub bucket counts the inserts it represents, which can exceed the labels
+   * it holds, so splitSizes keeps its occupied slots. Routes number the regular buckets first and
+   * then the sub buckets.
+   */
+  static constexpr uint32_t SplitFlag = 1U << 31;
+  uint64_t splitBits = 0, hotThreshold = std::numeric_limits<uint64_t>::max(), numSplit = 0;
+  uint8_t* tags = nullptr;
+  std::vector<Label_t> splitData;
+  std::vector<uint32_t> splitCounters, splitSizes;
+  std::vector<uint64_t> hotBuckets;
+  std::mutex hotLock;
+
+  // Counters only carry SplitFlag once splitting is enabled, below it they are plain counts.
+  bool IsSplit(uint32_t state) const { return splitBits > 0 && (state & SplitFlag); }
+
   constexpr uint64_t CounterIdx(uint64_t table, uint64_t row) { return table * range + row; }
 
   constexpr uint64_t DataIdx(uint64_t table, uint64_t row, uint64_t offset) {
     return table * range * reservoirSize + row * reservoirSize + offset;
   }
 
-  constexpr uint64_t HashIdx(uint64_t i, uint64_t table) { return i * numTables + table; }
+  /*
+   * Calls kernel with the TableShape of this table, fully fixed if its dimensions match an entry
+   * of SLASH_FIXED_CONFIGS and generic otherwise.
+   */
+  template <typename Kernel>
+  void Dispatch(Kernel&& kernel);
 
-  constexpr Hash_t HashMod(Hash_t hash) { return hash & mask; }
+  template <typename Shape>
+  void InsertLabel(const Shape& shape, uint64_t table, Hash_t hash, Label_t label);
+
+  // Sub bucket selected by the bits of hash above rangePow.
+  uint64_t SubBucket(Hash_t hash) const { return (hash >> rangePow) & ((1ULL << splitBits) - 1); }
+
+  // Bucket that hash reaches in table, following splits.
+  template <typename Shape>
+  uint64_t Route(const Shape& shape, uint64_t table, Hash_t hash) const;
+
+  template <typename Shape>
+  const Label_t* RouteSlots(const Shape& shape, uint64_t route) const;
+
+  template <typename Shape>
+  uint64_t RouteSize(const Shape& shape, uint64_t route) const;
+
+  // Splits the buckets whose counters reached hotThreshold during the last insert.
+  void SplitHotBuckets();
+
+  /*
+   * Removes the tombstoned labels among the size occupied slots if they make up at least
+   * minDeadFraction of them, moving the tags along, and returns the number of live slots.
+   */
+  uint64_t CompactSlots(Label_t* slots, uint8_t* slotTags, uint64_t size, double minDeadFraction,
+                        uint64_t table, uint64_t route);
+
+  // Inserts labels[i], or start + i when labels is null, for each of the n vectors.
+  template <typename Shape>
+  void InsertKernel(const Shape& shape, uint64_t n, const Label_t* labels, Label_t start,
+                    const Hash_t* hashes);
+
+  template <typename Shape>
+  void GatherTable(const Shape& shape, const Hash_t* tableHashes, uint64_t table, uint64_t probes,
+                   bool filterDeleted, const LabelBitmap* filter,
+                   std::vector<Label_t>& candidates);
+
+  template <typename Shape>
+  uint64_t TopK(const Shape& shape, const Hash_t* queryHashes, uint64_t k, uint64_t probes,
+                const LabelBitmap* filter, std::pair<Label_t, uint32_t>* out);
+
+  template <typename Shape>
+  uint64_t AnytimeTopK(const Shape& shape, const Hash_t* queryHashes, uint64_t k, uint64_t probes,
+                       uint64_t tableBudget, std::chrono::steady_clock::time_point deadline,
+                       std::pair<Label_t, uint32_t>* out, uint64_t& tablesUsed);
+
+  // A probe of the bucket major path, query is relative to the block and offset to its candidates.
+  struct Visit {
+    uint64_t route;
+    uint32_t query, size;
+    uint64_t offset;
+  };
+
+  // Queries per bucket major block, and whether a batch of n queries should use that path.
+  template <typename Shape>
+  uint64_t BucketMajorBlock(const Shape& shape, uint64_t probes) const;
+
+  template <typename Shape>
+  bool UseBucketMajor(const Shape& shape, uint64_t n, uint64_t probes) const;
+
+  /*
+   * Groups the probes of each block of queries by table and then by route, streams every probed
+   * bucket once into the candidates of the queries that probe it, and counts each query, passing
+   * its top k to emit(query, top, len).
+   */
+  template <typename Shape, typename Emit>
+  void BucketMajorKernel(const Shape& shape, uint64_t n, const Hash_t* hashes, uint64_t k,
+                         uint64_t probes, const LabelBitmap* filter, Emit&& emit);
+
+  template <typename Shape>
+  void QueryKernel(const Shape& shape, uint64_t n, const Hash_t* hashes, uint64_t k,
+                   QueryResult<Label_t>& result, uint64_t probes, const LabelBitmap* filter);
+
+  template <typename Shape>
+  void QueryAnytimeKernel(const Shape& shape, uint64_t n, const Hash_t* hashes, uint64_t k,
+                          uint64_t tableBudget, std::chrono::steady_clock::time_point deadline,
+                          QueryResult<Label_t>& result, uint64_t* tablesUsed, uint64_t probes);
+
+  template <typename Shape>
+  void QueryWithCountsKernel(const Shape& shape, uint64_t n, const Hash_t* hashes, uint64_t k,
+                             QueryResult<std::pair<Label_t, uint32_t>>& result, uint64_t probes,
+                             const LabelBitmap* filter);
 
  public:
+  static constexpr Label_t EmptySlot = std::numeric_limits<Label_t>::max();
+
+  /*
+   * In concurrent mode every slot starts out as EmptySlot and is published with a release store
+   * after its bucket counter is bumped, so Query can run while Insert is in progress and only
+   * ever observes fully written labels. Otherwise queries must not overlap inserts.
+   */
   HashTable(uint64_t _numTables, uint64_t _reservoirSize, uint64_t _rangePow,
-            uint64_t _maxRand = DefaultMaxRand);
+            uint64_t _maxRand = DefaultMaxRand, bool _concurrent = false);
+
+  bool IsConcurrent() const { return concurrent; }
+
+  // Disabling forces the generic kernels for every configuration, for benchmarking.
+  void SetFixedKernels(bool enabled) { fixedKernels = enabled; }
+
+  // Forcing an order instead of Auto is for benchmarking, both give the same results.
+  void SetQueryOrder(QueryOrder order) { queryOrder = order; }
+
+  // Whether Query and QueryWithCounts take the bucket major path for a batch of n queries.
+  bool PrefersBucketMajor(uint64_t n, uint64_t probes = 1);
+
+  void Insert(uint64_t n, const Label_t* labels, const Hash_t* hashes);
+
+  void Insert(uint64_t n, Label_t start, const Hash_t* hashes);
+
+  QueryResult<Label_t> Query(uint64_t n, const Hash_t* hashes, uint64_t k);
+
+  /*
+   * The in place query variants accept probes bucket ids per table, laid out as
+   * [query][table][probe] as produced by DOPH::Hash, and visit every distinct probed bucket.
+   * With a filter only the labels set in it are counted, so they are skipped while the buckets
+   * are scanned rather than after the top k has been selected.
+   */
+  void Query(uint64_t n, const Hash_t* hashes, uint64_t k, QueryResult<Label_t>& result,
+             uint64_t probes = 1, const LabelBitmap* filter = nullptr);
+
+  /*
+   * Anytime variant of Query that visits tables in order and stops once tableBudget tables have
+   * been visited, the deadline has passed, or the top k set is final because the unvisited
+   * tables can no longer close the gap between the k-th and (k+1)-th counts. The order within a
+   * final set reflects only the visited tables. At least one table is always visited, and the
+   * number visited by each query is written to tablesUsed.
+   */
+  void QueryAnytime(uint64_t n, const Hash_t* hashes, uint64_t k, uint64_t tableBudget,
+                    std::chrono::steady_clock::time_point deadline, QueryResult<Label_t>& result,
+                    uint64_t* tablesUsed, uint64_t probes = 1);
+
+  QueryResult<std::pair<Label_t, uint32_t>> QueryWithCounts(uint64_t n, const Hash_t* hashes,
+                                                            uint64_t k);
+
+  void QueryWithCounts(uint64_t n, const Hash_t* hashes, uint64_t k,
+                       QueryResult<std::pair<Label_t, uint32_t>>& result, uint64_t probes = 1,
+                       const LabelBitmap* filter = nullptr);
+
+  uint64_t Bytes() const {
+    return numTables * range * (reservoirSize * sizeof(Label_t) + sizeof(std::atomic<uint32_t>)) +
+           maxRand * sizeof(uint32_t) + tombstones.Bytes() +
+           (tags != nullptr ? numTables * range * reservoirSize : 0) +
+           splitData.capacity() * sizeof(Label_t) +
+           (splitCounters.capacity() + splitSizes.capacity()) * sizeof(uint32_t);
+  }
+
+  /*
+   * Splits buckets that grow far beyond the reservoir, which otherwise keep only a small sample of
+   * their members and cost every query that reaches them a full scan of low signal candidates.
+   * Once hotFactor * reservoirSize labels have been inserted into a bucket it is split into
+   * 2^splitBits sub buckets of reservoirSize slots, selected by the splitBits bits of each hash
+   * above rangePow, and later inserts and queries route to the sub bucket of their hash. The
+   * labels already sampled move to their sub buckets, for which a one byte tag is kept per slot,
+   * and each sub bucket counter is scaled to the share of inserts its labels represent. A sub
+   * bucket left with free slots admits later labels at the reservoir rate of that counter, filling
+   * free slots before replacing any, so the sample stays uniform over the bucket's inserts. Hashes
+   * must carry the extra bits, see Hasher::SplitBits, and splitting should be enabled before the
+   * first insert. Not supported by concurrent tables, since splitting moves slots.
+   */
+  void EnableSplitting(uint64_t _splitBits, double hotFactor);
+
+  uint64_t NumSplitBuckets() const { return numSplit; }
+
+  /*
+   * Number of slots that Query reads for the n queries, a measure of scan cost. Bucket major
+   * counts every bucket once per block no matter how many of the block's queries probe it.
+   */
+  uint64_t ScanSize(uint64_t n, const Hash_t* hashes, uint64_t probes = 1,
+                    QueryOrder order = QueryOrder::QueryMajor);
 
-  void Insert(uint64_t n, Label_t* labels, Hash_t* hashes);
+  /*
+   * Marks labels as deleted. Deleted labels are filtered out of query results immediately and
+   * their slots are reclaimed by Compact.
+   */
+  void Delete(uint64_t n, const Label_t* labels);
 
-  void Insert(uint64_t n, Label_t start, Hash_t* hashes);
+  /*
+   * Replaces the entries of existing labels with entries for their new hashes. The stale copies
+   * can only be located by scanning, so like Delete this tombstones the labels and leaves their
+   * slots to Compact, while queries and Compact keep the copy in each table's new bucket. A table
+   * whose new bucket still holds the label keeps that copy instead of gaining a second one.
+   */
+  void Update(uint64_t n, const Label_t* labels, const Hash_t* hashes);
 
-  QueryResult<Label_t> Query(uint64_t n, Hash_t* hashes, uint64_t k);
+  /*
+   * Removes tombstoned labels from every bucket in which they make up at least minDeadFraction
+   * of the occupied slots, lowering the bucket counter so that the freed slots are refilled by
+   * later inserts. Returns the number of slots reclaimed. A minDeadFraction of 0 purges every
+   * tombstoned label, after which the tombstones themselves are cleared. Queries wait for a
+   * running compaction and compaction waits for running queries, since moving live labels down a
+   * bucket under a scan could show one twice or not at all. Insert, Delete and Update must not
+   * overlap it.
+   */
+  uint64_t Compact(double minDeadFraction);
 
-  QueryResult<std::pair<Label_t, uint32_t>> QueryWithCounts(uint64_t n, Hash_t* hashes, uint64_t k);
+  uint64_t NumDeleted() const { return tombstones.Count(); }
 
   void Dump();
 
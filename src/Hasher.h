@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "DataLoader.h"
+
+/*
+ * A locality sensitive hash family that maps each vector to one bucket id of RangePow() bits in
+ * each of NumTables() tables. Slash hashes every batch it inserts or queries through this
+ * interface, and the HashTable only ever sees the resulting bucket ids, so the family can be
+ * chosen per index. Implementations must be deterministic across processes, since every rank
+ * hashes its own shard and the queries independently.
+ */
+class Hasher {
+ public:
+  virtual ~Hasher() = default;
+
+  /*
+   * Writes probes bucket ids per table for rows [offset, offset + num) of batch, laid out as
+   * [vector][table][probe]. Probe 0 is the regular bucket and further probes are the next most
+   * likely buckets of a near neighbour. May be called concurrently from different threads.
+   */
+  virtual void Hash(const CsrView& batch, uint64_t offset, uint64_t num, uint32_t* hashes,
+                    uint64_t probes = 1) = 0;
+
+  virtual uint64_t NumTables() const = 0;
+
+  virtual uint64_t RangePow() const = 0;
+
+  /*
+   * Number of bits above RangePow() of each bucket id that can carry a secondary hash, which
+   * HashTable uses to split hot buckets.
+   */
+  virtual uint64_t SplitBits() const { return 0; }
+
+  /*
+   * Makes Hash write the secondary hash to the given number of the lowest of those bits. The rest,
+   * and all of them until this is called, are zero, so tables that do not split see plain buckets.
+   */
+  virtual void SetSplitBits(uint64_t) {}
+};
@@ -0,0 +1,116 @@
+#include "Memory.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "DistributedLog.h"
+#include "HashTable.h"
+
+// Size of std::pair<Label_t, uint32_t>, which pads to the alignment of the label.
+static uint64_t CountPairBytes(uint64_t labelBytes) {
+  return std::max<uint64_t>(labelBytes, 4) * 2;
+}
+
+// Indices and values of len rows of avgDim nonzeros on average, plus the row markers.
+static uint64_t DatasetBytes(uint64_t len, uint64_t avgDim) {
+  return len * avgDim * (sizeof(uint32_t) + sizeof(float)) + (len + 1) * sizeof(uint64_t);
+}
+
+MemoryPlan PlanMemory(const MemoryParams& p) {
+  MemoryPlan plan;
+  uint64_t buckets = p.L << p.rangePow;
+  uint64_t pairBytes = CountPairBytes(p.labelBytes);
+
+  plan.tables = buckets * p.reservoirSize * (p.labelBytes + p.slotTagBytes);
+  plan.counters = buckets * sizeof(uint32_t) + DefaultMaxRand * sizeof(uint32_t);
+
+  plan.datasets = DatasetBytes(p.localN, p.avgDim) + DatasetBytes(p.Q, p.avgDim);
+  if (p.evalN > 0) {
+    plan.datasets += DatasetBytes(p.evalN, p.avgDim) + DatasetBytes(p.Q, p.avgDim);
+    // Quantized values, norms and scales, which exist next to the floats while converting.
+    if (p.evalValueBytes > 0) {
+      plan.datasets += p.evalN * (p.avgDim * p.evalValueBytes + 2 * sizeof(float));
+    }
+  }
+
+  // Bucket ids of the largest batch, where a query keeps one per probe, plus each thread's min
+  // hash bins, which multiprobe doubles for the second smallest values.
+  uint64_t binCopies = p.probes > 1 ? 4 : 2;
+  plan.hashBuffers = std::max(p.batchSize, p.Q * p.probes) * p.L * sizeof(uint32_t) +
+                     p.threads * binCopies * p.K * p.L * sizeof(uint32_t);
+
+  // A query can gather a full reservoir from every probed bucket, and each thread keeps its own
+  // buffer.
+  plan.queryBuffers = p.threads * p.L * p.probes * p.reservoirSize * (p.labelBytes + pairBytes) +
+                      p.threads * p.topk * pairBytes + p.Q * p.topk * (p.labelBytes + pairBytes) +
+                      2 * p.Q * sizeof(uint64_t);
+
+  // A bucket major block of queries, which either query order may take, keeps a visit per probe
+  // (a route, query, size and offset), the offsets of each query and the gathered candidates.
+  uint64_t probesPerQuery = p.L * p.probes;
+  uint64_t block = std::min(
+      p.Q, std::max<uint64_t>(
+               1, BucketMajorBlockBytes() / (probesPerQuery * p.reservoirSize * p.labelBytes)));
+  plan.queryBuffers += block * probesPerQuery * (2 * sizeof(uint64_t) + 2 * sizeof(uint32_t)) +
+                       (block + 1) * sizeof(uint64_t) +
+                       block * probesPerQuery * p.reservoirSize * p.labelBytes;
+
+  plan.mpiBuffers = 3 * p.Q * p.topk * 2 * p.labelBytes;
+  return plan;
+}
+
+void MemoryPlan::Log() const {
+  auto mb = [](uint64_t bytes) { return bytes / (double)(1 << 20); };
+  LOG << "Planned memory (MB): tables " << mb(tables) << " counters " << mb(counters)
+      << " datasets " << mb(datasets) << " hash buffers " << mb(hashBuffers) << " query buffers "
+      << mb(queryBuffers) << " mpi buffers " << mb(mpiBuffers) << " total " << mb(Total())
+      << std::endl;
+}
+
+MemoryParams FitMemoryBudget(MemoryParams params, uint64_t budgetBytes) {
+  uint64_t maxReservoir = params.reservoirSize;
+  for (uint64_t step = 0; PlanMemory(params).Total() > budgetBytes; step++) {
+    // Once the range is at its floor only the reservoir can still shrink.
+    bool rangeAtFloor = params.rangePow <= MinBudgetRangePow;
+    if ((step % 2 == 0 || rangeAtFloor) && params.reservoirSize > 1) {
+      params.reservoirSize /= 2;
+    } else if (!rangeAtFloor) {
+      params.rangePow--;
+    } else {
+      throw std::runtime_error("memory_budget of " + std::to_string(budgetBytes) +
+                               " bytes cannot fit the index even at range_pow " +
+                               std::to_string(MinBudgetRangePow) + " and reservoir_size 1");
+    }
+  }
+
+  // The plan is linear in the reservoir apart from the bucket major block, which holds fewer
+  // queries as the reservoir grows, so the largest reservoir that fits follows from the cost of
+  // one more slot per bucket and is checked against the full plan.
+  MemoryPlan base = PlanMemory(params);
+  params.reservoirSize++;
+  uint64_t perSlot = PlanMemory(params).Total() - base.Total();
+  uint64_t fitted = params.reservoirSize - 1;
+  params.reservoirSize = std::min(maxReservoir, fitted + (budgetBytes - base.Total()) / perSlot);
+  while (params.reservoirSize > fitted && PlanMemory(params).Total() > budgetBytes) {
+    params.reservoirSize--;
+  }
+  return params;
+}
+
+// Reads a "Key:   value kB" line of /proc/self/status.
+static uint64_t ProcStatusBytes(const std::string& key) {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, key.size() + 1, key + ":") == 0) {
+      return std::stoull(line.substr(key.size() + 1)) * 1024;
+    }
+  }
+  return 0;
+}
+
+uint64_t ResidentBytes() { return ProcStatusBytes("VmRSS"); }
+
+uint64_t PeakResidentBytes() { return ProcStatusBytes("VmHWM"); }
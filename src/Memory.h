@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+// Smallest range_pow FitMemoryBudget will lower the configuration to.
+constexpr uint64_t MinBudgetRangePow = 8;
+
+/*
+ * Everything that determines the memory of one rank. Counts are in elements, labelBytes is
+ * sizeof(Label_t), avgDim is the mean number of nonzeros per row and evalN is the number of data
+ * rows loaded for evaluation, 0 on ranks that do not evaluate. evalValueBytes is the bytes per
+ * nonzero of quantized evaluation values, 0 if they are kept as floats. slotTagBytes is the bytes
+ * per slot of sub bucket tags, 1 when hot bucket splitting is enabled and 0 otherwise. The sub
+ * buckets themselves grow with the data and are not planned. probes is the largest number of
+ * buckets a query probes per table.
+ */
+struct MemoryParams {
+  uint64_t K, L, rangePow, reservoirSize, labelBytes;
+  uint64_t localN, Q, avgDim, batchSize, topk, threads, evalN, evalValueBytes, slotTagBytes;
+  uint64_t probes;
+};
+
+/*
+ * Bytes that each component of a rank will allocate, computed from the same sizes that
+ * HashTable, SvmDataset and Slash use for their allocations.
+ */
+struct MemoryPlan {
+  uint64_t tables = 0;        // Bucket slots.
+  uint64_t counters = 0;      // Bucket counters and the reservoir sampling table.
+  uint64_t datasets = 0;      // Local data shard, queries and evaluation data.
+  uint64_t hashBuffers = 0;   // Per thread bucket id and min hash scratch.
+  uint64_t queryBuffers = 0;  // Candidate scratch, bucket major blocks and query results.
+  uint64_t mpiBuffers = 0;    // Top k reduction buffers.
+
+  uint64_t Total() const {
+    return tables + counters + datasets + hashBuffers + queryBuffers + mpiBuffers;
+  }
+
+  void Log() const;
+};
+
+MemoryPlan PlanMemory(const MemoryParams& params);
+
+/*
+ * Returns params with the largest reservoirSize and rangePow, no larger than the configured ones,
+ * whose plan fits in budgetBytes. The reservoir is halved and the range narrowed by one bit in
+ * turn, the reservoir alone once the range reaches MinBudgetRangePow, until the plan fits, then
+ * the reservoir is grown back as far as the budget allows. Throws std::runtime_error if nothing
+ * down to MinBudgetRangePow and a reservoir of 1 fits.
+ */
+MemoryParams FitMemoryBudget(MemoryParams params, uint64_t budgetBytes);
+
+// Resident and peak resident set size of this process from /proc/self/status, 0 if unavailable.
+uint64_t ResidentBytes();
+
+uint64_t PeakResidentBytes();
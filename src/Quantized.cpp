@@ -0,0 +1,303 @@
+#include "Quantized.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+ValueFormat ParseValueFormat(const std::string& name) {
+  if (name == "float") {
+    return ValueFormat::Float;
+  }
+  if (name == "fp16") {
+    return ValueFormat::Fp16;
+  }
+  if (name == "bf16") {
+    return ValueFormat::Bf16;
+  }
+  if (name == "int8") {
+    return ValueFormat::Int8;
+  }
+  throw std::invalid_argument("Invalid value format " + name +
+                              ", expected float, fp16, bf16 or int8");
+}
+
+const char* ValueFormatName(ValueFormat format) {
+  switch (format) {
+    case ValueFormat::Float:
+      return "float";
+    case ValueFormat::Fp16:
+      return "fp16";
+    case ValueFormat::Bf16:
+      return "bf16";
+    case ValueFormat::Int8:
+      return "int8";
+  }
+  return "unknown";
+}
+
+static uint32_t FloatBits(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+static float BitsFloat(uint32_t bits) {
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Rounds to nearest even, saturating to infinity. Values are finite, so NaN is not handled.
+static uint16_t FloatToHalf(float f) {
+  uint32_t x = FloatBits(f);
+  uint32_t sign = (x >> 16) & 0x8000;
+  int32_t exp = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+  if (exp >= 31) {
+    return sign | 0x7c00;
+  }
+  if (exp <= 0) {
+    // Subnormal, the implicit bit becomes explicit and is shifted into the 10 bit mantissa.
+    if (exp < -10) {
+      return sign;
+    }
+    mant |= 0x800000;
+    uint32_t shift = 14 - exp;
+    uint32_t half = mant >> shift;
+    uint32_t rem = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+    if (rem > mid || (rem == mid && (half & 1))) {
+      half++;
+    }
+    return sign | half;
+  }
+  // A carry out of the mantissa correctly increments the exponent.
+  uint32_t half = sign | ((uint32_t)exp << 10) | (mant >> 13);
+  uint32_t rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) {
+    half++;
+  }
+  return half;
+}
+
+static float HalfToFloat(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  if (exp == 0) {
+    float f = mant * (1.0f / (1 << 24));
+    return sign ? -f : f;
+  }
+  if (exp == 31) {
+    return BitsFloat(sign | 0x7f800000 | (mant << 13));
+  }
+  return BitsFloat(sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+static uint16_t FloatToBfloat(float f) {
+  uint32_t x = FloatBits(f);
+  return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static float BfloatToFloat(uint16_t b) { return BitsFloat((uint32_t)b << 16); }
+
+/*
+ * Decoders of one row's values. Get returns a single value and Load8 the 8 values starting at i
+ * as floats in a register.
+ */
+struct FloatValues {
+  const float* values;
+
+  float Get(uint64_t i) const { return values[i]; }
+
+#ifdef __AVX2__
+  __m256 Load8(uint64_t i) const { return _mm256_loadu_ps(values + i); }
+#endif
+};
+
+struct HalfValues {
+  const uint16_t* values;
+
+  float Get(uint64_t i) const { return HalfToFloat(values[i]); }
+
+#if defined(__AVX2__) && defined(__F16C__)
+  __m256 Load8(uint64_t i) const {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(values + i)));
+  }
+#elif defined(__AVX2__)
+  __m256 Load8(uint64_t i) const {
+    float decoded[8];
+    for (uint64_t j = 0; j < 8; j++) {
+      decoded[j] = HalfToFloat(values[i + j]);
+    }
+    return _mm256_loadu_ps(decoded);
+  }
+#endif
+};
+
+struct BfloatValues {
+  const uint16_t* values;
+
+  float Get(uint64_t i) const { return BfloatToFloat(values[i]); }
+
+#ifdef __AVX2__
+  __m256 Load8(uint64_t i) const {
+    __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(values + i)));
+    return _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+  }
+#endif
+};
+
+struct Int8Values {
+  const int8_t* values;
+  float scale;
+
+  float Get(uint64_t i) const { return values[i] * scale; }
+
+#ifdef __AVX2__
+  __m256 Load8(uint64_t i) const {
+    __m128i packed = _mm_loadl_epi64((const __m128i*)(values + i));
+    __m256 wide = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(packed));
+    return _mm256_mul_ps(wide, _mm256_set1_ps(scale));
+  }
+#endif
+};
+
+/*
+ * Sparse dot product of two rows sorted by index. A block of 8 indices of each side is compared
+ * against all 8 rotations of the other, so every pair within the blocks is tested once, and the
+ * side whose block ends first advances. Indices within a row are unique, so each element matches
+ * at most once. The remaining elements are merged one at a time.
+ */
+template <typename Values>
+static double SparseDot(const uint32_t* iA, const float* vA, uint64_t lA, const uint32_t* iB,
+                        Values vB, uint64_t lB) {
+  uint64_t a = 0, b = 0;
+  double val = 0;
+
+#ifdef __AVX2__
+  const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  __m256 sum = _mm256_setzero_ps();
+  while (a + 8 <= lA && b + 8 <= lB) {
+    __m256i idxA = _mm256_loadu_si256((const __m256i*)(iA + a));
+    __m256i idxB = _mm256_loadu_si256((const __m256i*)(iB + b));
+    __m256 valA = _mm256_loadu_ps(vA + a);
+    __m256 valB = vB.Load8(b);
+    for (uint32_t r = 0; r < 8; r++) {
+      __m256 match = _mm256_castsi256_ps(_mm256_cmpeq_epi32(idxA, idxB));
+      sum = _mm256_add_ps(sum, _mm256_and_ps(match, _mm256_mul_ps(valA, valB)));
+      idxB = _mm256_permutevar8x32_epi32(idxB, rotate);
+      valB = _mm256_permutevar8x32_ps(valB, rotate);
+    }
+    uint32_t lastA = iA[a + 7], lastB = iB[b + 7];
+    a += lastA <= lastB ? 8 : 0;
+    b += lastB <= lastA ? 8 : 0;
+  }
+  float lanes[8];
+  _mm256_storeu_ps(lanes, sum);
+  for (uint32_t i = 0; i < 8; i++) {
+    val += lanes[i];
+  }
+#endif
+
+  while (a < lA && b < lB) {
+    if (iA[a] == iB[b]) {
+      val += vA[a] * vB.Get(b);
+      a++;
+      b++;
+    } else if (iA[a] < iB[b]) {
+      a++;
+    } else {
+      b++;
+    }
+  }
+  return val;
+}
+
+QuantizedRows::QuantizedRows(const CsrView& data, ValueFormat _format)
+    : view(data), format(_format), norms(data.len) {
+  uint64_t nnz = data.markers[data.len] - data.markers[0];
+  if (format == ValueFormat::Fp16 || format == ValueFormat::Bf16) {
+    halfs.resize(nnz);
+  } else if (format == ValueFormat::Int8) {
+    bytes.resize(nnz);
+    scales.resize(data.len);
+  }
+
+#pragma omp parallel for default(none) shared(data)
+  for (uint64_t row = 0; row < data.len; row++) {
+    const float* values = data.Values(row);
+    uint64_t len = data.Len(row);
+    uint64_t start = data.markers[row] - data.markers[0];
+
+    double squares = 0;
+    float maxAbs = 0;
+    for (uint64_t i = 0; i < len; i++) {
+      squares += values[i] * values[i];
+      maxAbs = std::max(maxAbs, fabsf(values[i]));
+    }
+    norms[row] = sqrt(squares);
+
+    if (format == ValueFormat::Fp16) {
+      for (uint64_t i = 0; i < len; i++) {
+        halfs[start + i] = FloatToHalf(values[i]);
+      }
+    } else if (format == ValueFormat::Bf16) {
+      for (uint64_t i = 0; i < len; i++) {
+        halfs[start + i] = FloatToBfloat(values[i]);
+      }
+    } else if (format == ValueFormat::Int8) {
+      scales[row] = maxAbs > 0 ? maxAbs / 127 : 1;
+      for (uint64_t i = 0; i < len; i++) {
+        bytes[start + i] = (int8_t)lrintf(values[i] / scales[row]);
+      }
+    }
+  }
+
+  if (format != ValueFormat::Float) {
+    view.values = nullptr;
+  }
+}
+
+double QuantizedRows::Dot(const uint32_t* indices, const float* values, uint64_t len,
+                          uint64_t row) const {
+  uint64_t start = view.markers[row] - view.markers[0];
+  switch (format) {
+    case ValueFormat::Float:
+      return SparseDot(indices, values, len, view.Indices(row), FloatValues{view.Values(row)},
+                       view.Len(row));
+    case ValueFormat::Fp16:
+      return SparseDot(indices, values, len, view.Indices(row), HalfValues{halfs.data() + start},
+                       view.Len(row));
+    case ValueFormat::Bf16:
+      return SparseDot(indices, values, len, view.Indices(row), BfloatValues{halfs.data() + start},
+                       view.Len(row));
+    case ValueFormat::Int8:
+      return SparseDot(indices, values, len, view.Indices(row),
+                       Int8Values{bytes.data() + start, scales[row]}, view.Len(row));
+  }
+  return 0;
+}
+
+uint64_t QuantizedRows::ValueBytes(ValueFormat format) {
+  switch (format) {
+    case ValueFormat::Float:
+      return sizeof(float);
+    case ValueFormat::Fp16:
+    case ValueFormat::Bf16:
+      return sizeof(uint16_t);
+    case ValueFormat::Int8:
+      return sizeof(int8_t);
+  }
+  return 0;
+}
+
+uint64_t QuantizedRows::Bytes() const {
+  uint64_t nnz = view.markers[view.len] - view.markers[0];
+  return nnz * ValueBytes(format) + (scales.size() + norms.size()) * sizeof(float);
+}
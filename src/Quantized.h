@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "DataLoader.h"
+
+// Storage format of the values of a QuantizedRows.
+enum class ValueFormat {
+  Float,  // The original 32 bit floats, not copied.
+  Fp16,   // IEEE half precision, round to nearest even.
+  Bf16,   // Upper 16 bits of the float, round to nearest even.
+  Int8,   // Per row scaled to [-127, 127], one float scale per row.
+};
+
+// Parses "float", "fp16", "bf16" or "int8", throws std::invalid_argument otherwise.
+ValueFormat ParseValueFormat(const std::string& name);
+
+const char* ValueFormatName(ValueFormat format);
+
+/*
+ * The values of a CSR dataset in a compact format, with the L2 norm of every row computed from the
+ * original floats. Indices and markers are shared with the source, which must outlive this object,
+ * but for any format other than Float the source values are no longer read once constructed and may
+ * be released.
+ *
+ * Dot products run directly on the compact values. With AVX2 the sorted index lists are
+ * intersected 8 x 8 at a time, comparing one block against every rotation of the other, and the
+ * matching values are decoded to floats in registers.
+ */
+class QuantizedRows {
+ public:
+  QuantizedRows(const CsrView& data, ValueFormat format);
+
+  ValueFormat Format() const { return format; }
+
+  uint64_t Len() const { return view.len; }
+
+  float Norm(uint64_t row) const { return norms[row]; }
+
+  // Dot product of a float query, sorted by index, with a row.
+  double Dot(const uint32_t* indices, const float* values, uint64_t len, uint64_t row) const;
+
+  // Cosine similarity of a float query with a row, given the norm of the query.
+  double Cosine(const uint32_t* indices, const float* values, uint64_t len, double norm,
+                uint64_t row) const {
+    return Dot(indices, values, len, row) / (norm * norms[row]);
+  }
+
+  // Bytes per nonzero of the value store, excluding the per row norms and scales.
+  static uint64_t ValueBytes(ValueFormat format);
+
+  // Bytes of the values, scales and norms, counting the shared source values for Float.
+  uint64_t Bytes() const;
+
+ private:
+  CsrView view;
+  ValueFormat format;
+  std::vector<uint16_t> halfs;
+  std::vector<int8_t> bytes;
+  std::vector<float> scales, norms;
+};
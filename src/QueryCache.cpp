@@ -0,0 +1,147 @@
+#include "QueryCache.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "DistributedLog.h"
+
+template class QueryCache<uint32_t>;
+template class QueryCache<uint64_t>;
+
+template <typename Label_t>
+QueryCache<Label_t>::QueryCache(uint64_t capacity, uint64_t numShards)
+    : epoch(0), hits(0), misses(0), stale(0), evictions(0) {
+  if (capacity == 0 || numShards == 0) {
+    throw std::invalid_argument("QueryCache needs at least one entry and one shard");
+  }
+  numShards = std::min(numShards, capacity);
+  for (uint64_t s = 0; s < numShards; s++) {
+    shards.emplace_back(new Shard);
+    // Spread the remainder so that the shards hold exactly capacity entries in total.
+    shards.back()->entries.resize(capacity / numShards + (s < capacity % numShards));
+  }
+}
+
+template <typename Label_t>
+uint64_t QueryCache<Label_t>::Key(const uint32_t* signature, uint64_t len, uint64_t topk) {
+  uint64_t key = topk * 0x9E3779B97F4A7C15ULL;
+  for (uint64_t i = 0; i < len; i++) {
+    key = (key ^ signature[i]) * 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 32;
+  }
+  return key;
+}
+
+template <typename Label_t>
+uint64_t QueryCache<Label_t>::EntryBytes(const Entry& entry) {
+  // Each index node holds the key, the slot and a next pointer.
+  return sizeof(Entry) + entry.signature.capacity() * sizeof(uint32_t) +
+         entry.results.capacity() * sizeof(Label_t) + 3 * sizeof(uint64_t);
+}
+
+template <typename Label_t>
+bool QueryCache<Label_t>::Lookup(const uint32_t* signature, uint64_t len, uint64_t topk,
+                                 Label_t* results, uint64_t& resultLen) {
+  uint64_t key = Key(signature, len, topk);
+  Shard& shard = *shards[key % shards.size()];
+  uint64_t current = Epoch();
+
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto it = shard.index.find(key);
+  if (it == shard.index.end()) {
+    misses++;
+    return false;
+  }
+  Entry& entry = shard.entries[it->second];
+  if (entry.topk != topk || entry.signature.size() != len ||
+      !std::equal(signature, signature + len, entry.signature.begin())) {
+    misses++;
+    return false;
+  }
+  if (entry.epoch != current) {
+    misses++;
+    stale++;
+    return false;
+  }
+
+  entry.referenced = true;
+  resultLen = entry.results.size();
+  std::copy(entry.results.begin(), entry.results.end(), results);
+  hits++;
+  return true;
+}
+
+template <typename Label_t>
+uint64_t QueryCache<Label_t>::Victim(Shard& shard) {
+  if (shard.used < shard.entries.size()) {
+    return shard.used++;
+  }
+  uint64_t current = Epoch();
+  while (true) {
+    Entry& entry = shard.entries[shard.hand];
+    uint64_t slot = shard.hand;
+    shard.hand = (shard.hand + 1) % shard.entries.size();
+    if (!entry.referenced || entry.epoch != current) {
+      shard.index.erase(entry.key);
+      evictions++;
+      return slot;
+    }
+    entry.referenced = false;
+  }
+}
+
+template <typename Label_t>
+void QueryCache<Label_t>::Store(const uint32_t* signature, uint64_t len, uint64_t topk,
+                                uint64_t queryEpoch, const Label_t* results, uint64_t resultLen) {
+  uint64_t key = Key(signature, len, topk);
+  Shard& shard = *shards[key % shards.size()];
+
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto it = shard.index.find(key);
+  uint64_t slot;
+  if (it != shard.index.end()) {
+    slot = it->second;
+  } else {
+    slot = Victim(shard);
+    shard.index[key] = slot;
+  }
+
+  Entry& entry = shard.entries[slot];
+  shard.bytes -= entry.used ? EntryBytes(entry) : 0;
+  entry.key = key;
+  entry.epoch = queryEpoch;
+  entry.topk = topk;
+  entry.used = true;
+  entry.referenced = false;
+  entry.signature.assign(signature, signature + len);
+  entry.results.assign(results, results + resultLen);
+  shard.bytes += EntryBytes(entry);
+}
+
+template <typename Label_t>
+typename QueryCache<Label_t>::Stats QueryCache<Label_t>::GetStats() const {
+  Stats stats{hits, misses, stale, evictions, 0, 0};
+  for (const auto& shard : shards) {
+    std::lock_guard<std::mutex> guard(shard->lock);
+    stats.entries += shard->used;
+    stats.bytes += shard->bytes;
+  }
+  return stats;
+}
+
+template <typename Label_t>
+void QueryCache<Label_t>::ResetStats() {
+  hits = 0;
+  misses = 0;
+  stale = 0;
+  evictions = 0;
+}
+
+template <typename Label_t>
+void QueryCache<Label_t>::Log(const std::string& name) const {
+  Stats stats = GetStats();
+  LOG << name << ": hit rate = " << stats.HitRate() << " hits = " << stats.hits
+      << " misses = " << stats.misses << " stale = " << stats.stale
+      << " evictions = " << stats.evictions << " entries = " << stats.entries
+      << " memory = " << stats.bytes / (double)(1 << 20) << " MB" << std::endl;
+}
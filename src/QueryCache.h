@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Number of independently locked shards of a QueryCache.
+constexpr uint64_t DefaultCacheShards = 64;
+
+/*
+ * Concurrent cache of top k results keyed by a query's signature, the bucket ids it probes in every
+ * table. Two queries with the same signature read exactly the same buckets and so get the same
+ * results, which makes exact and near exact repeats hits. The full signature is kept with each
+ * entry and compared on lookup, so a collision of the 64 bit key is a miss rather than a wrong
+ * result.
+ *
+ * Entries are split across shards that each hold a fixed number of slots under CLOCK replacement:
+ * a hit sets the slot's reference bit and the hand clears reference bits until it finds a slot to
+ * evict. Any change to the tables calls Invalidate, which advances a global epoch in O(1). Entries
+ * from older epochs are never returned and are the first to be evicted.
+ */
+template <typename Label_t>
+class QueryCache {
+ public:
+  struct Stats {
+    uint64_t hits, misses, stale, evictions, entries, bytes;
+
+    double HitRate() const { return hits + misses > 0 ? (double)hits / (hits + misses) : 0; }
+  };
+
+  QueryCache(uint64_t capacity, uint64_t numShards = DefaultCacheShards);
+
+  QueryCache(const QueryCache& other) = delete;
+  QueryCache& operator=(const QueryCache& other) = delete;
+
+  /*
+   * Epoch to pass to Store for results computed after this call. Reading it before the tables
+   * means results that raced with a change to the tables are stored as already stale.
+   */
+  uint64_t Epoch() const { return epoch.load(std::memory_order_acquire); }
+
+  // Copies up to topk cached labels into results and returns true on a hit.
+  bool Lookup(const uint32_t* signature, uint64_t len, uint64_t topk, Label_t* results,
+              uint64_t& resultLen);
+
+  void Store(const uint32_t* signature, uint64_t len, uint64_t topk, uint64_t queryEpoch,
+             const Label_t* results, uint64_t resultLen);
+
+  // Must be called after every change to the tables.
+  void Invalidate() { epoch.fetch_add(1, std::memory_order_acq_rel); }
+
+  Stats GetStats() const;
+
+  void ResetStats();
+
+  void Log(const std::string& name) const;
+
+ private:
+  struct Entry {
+    uint64_t key = 0, epoch = 0, topk = 0;
+    bool used = false, referenced = false;
+    std::vector<uint32_t> signature;
+    std::vector<Label_t> results;
+  };
+
+  struct Shard {
+    std::mutex lock;
+    std::vector<Entry> entries;
+    std::unordered_map<uint64_t, uint64_t> index;
+    uint64_t hand = 0, used = 0, bytes = 0;
+  };
+
+  static uint64_t Key(const uint32_t* signature, uint64_t len, uint64_t topk);
+
+  static uint64_t EntryBytes(const Entry& entry);
+
+  // Slot to overwrite for a new key, advancing the CLOCK hand. Called with the shard locked.
+  uint64_t Victim(Shard& shard);
+
+  std::vector<std::unique_ptr<Shard>> shards;
+  std::atomic<uint64_t> epoch;
+  std::atomic<uint64_t> hits, misses, stale, evictions;
+};
@@ -0,0 +1,301 @@
+#include "QueryServer.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#include "DistributedLog.h"
+
+bool ReadFully(int fd, void* buf, uint64_t len) {
+  char* ptr = static_cast<char*>(buf);
+  while (len > 0) {
+    ssize_t got = read(fd, ptr, len);
+    if (got <= 0) {
+      return false;
+    }
+    ptr += got;
+    len -= got;
+  }
+  return true;
+}
+
+bool WriteFully(int fd, const void* buf, uint64_t len) {
+  const char* ptr = static_cast<const char*>(buf);
+  while (len > 0) {
+    ssize_t put = send(fd, ptr, len, MSG_NOSIGNAL);
+    if (put <= 0) {
+      return false;
+    }
+    ptr += put;
+    len -= put;
+  }
+  return true;
+}
+
+static sockaddr_un UnixAddress(const std::string& path) {
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + path);
+  }
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+int ConnectUnixSocket(const std::string& path) {
+  sockaddr_un addr = UnixAddress(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    std::string error = strerror(errno);
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw std::runtime_error("Unable to connect to socket " + path + ": " + error);
+  }
+  return fd;
+}
+
+double LatencyStats::Percentile(double p) {
+  if (samples.empty()) {
+    return 0;
+  }
+  uint64_t idx = std::min<uint64_t>(std::ceil(p * samples.size()), samples.size()) - 1;
+  std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+  return samples[idx];
+}
+
+void LatencyStats::Log(const std::string& name, double elapsedSeconds, const std::string& unit) {
+  LOG << name << ": " << Count() << " " << unit << " in " << elapsedSeconds << " seconds, "
+      << Count() / elapsedSeconds << " " << unit << "/sec p50 = " << Percentile(0.5)
+      << " us p99 = " << Percentile(0.99) << " us" << std::endl;
+}
+
+template class QueryServer<uint32_t>;
+template class QueryServer<uint64_t>;
+
+template <typename Label_t>
+QueryServer<Label_t>::QueryServer(Slash<Label_t>& _slash, std::string _socketPath,
+                                  uint64_t _maxBatch, uint64_t _maxWaitMicros, uint64_t _topk,
+                                  uint64_t _deadlineMicros, uint64_t _maxNnz)
+    : slash(_slash),
+      socketPath(_socketPath),
+      maxBatch(_maxBatch),
+      maxWaitMicros(_maxWaitMicros),
+      topk(_topk),
+      deadlineMicros(_deadlineMicros),
+      maxNnz(_maxNnz),
+      stopping(false) {
+  sockaddr_un addr = UnixAddress(socketPath);
+  unlink(socketPath.c_str());
+
+  listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(listenFd, 128) < 0) {
+    throw std::runtime_error("Unable to listen on socket " + socketPath + ": " + strerror(errno));
+  }
+}
+
+template <typename Label_t>
+void QueryServer<Label_t>::Run() {
+  LOG << "Serving queries on " << socketPath << " max_batch = " << maxBatch
+      << " max_wait = " << maxWaitMicros << " us" << std::endl;
+
+  acceptor = std::thread(&QueryServer<Label_t>::AcceptLoop, this);
+
+  Clock::time_point start;
+  std::vector<PendingQuery> batch;
+  while (true) {
+    std::unique_lock<std::mutex> lock(queueLock);
+    queueCv.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (queue.empty()) {
+      break;
+    }
+    if (batchSizes.empty()) {
+      start = queue.front().arrival;
+    }
+
+    // Hold the batch open until it is full or its oldest query has waited max_wait.
+    auto deadline = queue.front().arrival + std::chrono::microseconds(maxWaitMicros);
+    queueCv.wait_until(lock, deadline, [this] { return stopping || queue.size() >= maxBatch; });
+
+    uint64_t n = std::min<uint64_t>(maxBatch, queue.size());
+    for (uint64_t i = 0; i < n; i++) {
+      batch.push_back(std::move(queue.front()));
+      queue.pop_front();
+    }
+    lock.unlock();
+
+    ProcessBatch(batch);
+    // Releases the batch's connections, which close once their readers have returned.
+    batch.clear();
+  }
+  auto end = Clock::now();
+
+  double elapsed = std::chrono::duration<double>(end - start).count();
+  latencies.Log("Server", elapsed);
+  if (!batchSizes.empty()) {
+    LOG << "Server: " << batchSizes.size() << " batches, average batch size = "
+        << std::accumulate(batchSizes.begin(), batchSizes.end(), 0.0) / batchSizes.size()
+        << std::endl;
+  }
+  if (deadlineMicros > 0 && latencies.Count() > 0) {
+    LOG << "Server: average tables visited under a " << deadlineMicros
+        << " us deadline = " << (double)totalTablesUsed / latencies.Count() << std::endl;
+  }
+
+  Stop();
+}
+
+template <typename Label_t>
+void QueryServer<Label_t>::ProcessBatch(std::vector<PendingQuery>& batch) {
+  batchIndices.clear();
+  batchValues.clear();
+  batchMarkers.clear();
+  for (const auto& query : batch) {
+    batchMarkers.push_back(batchIndices.size());
+    batchIndices.insert(batchIndices.end(), query.indices.begin(), query.indices.end());
+    batchValues.insert(batchValues.end(), query.values.begin(), query.values.end());
+  }
+  batchMarkers.push_back(batchIndices.size());
+
+  CsrView queries{batch.size(), batchIndices.data(), batchValues.data(), batchMarkers.data()};
+  if (deadlineMicros > 0) {
+    tablesUsed.resize(batch.size());
+    auto deadline = batch.front().arrival + std::chrono::microseconds(deadlineMicros);
+    slash.QueryAnytime(queries, topk, UINT64_MAX, deadline, results, tablesUsed.data());
+    totalTablesUsed += std::accumulate(tablesUsed.begin(), tablesUsed.end(), (uint64_t)0);
+  } else {
+    slash.QuerySVMSingleMachine(queries, topk, results);
+  }
+
+  for (uint64_t i = 0; i < batch.size(); i++) {
+    uint32_t len = results.len(i);
+    {
+      Connection& conn = *batch[i].conn;
+      std::lock_guard<std::mutex> guard(conn.writeLock);
+      // A client that has gone away is shut down, so that its reader returns and drops it.
+      if (!conn.broken && (!WriteFully(conn.fd, &len, sizeof(uint32_t)) ||
+                           !WriteFully(conn.fd, results[i], len * sizeof(Label_t)))) {
+        conn.broken = true;
+        shutdown(conn.fd, SHUT_RDWR);
+      }
+    }
+    latencies.Record(
+        std::chrono::duration<double, std::micro>(Clock::now() - batch[i].arrival).count());
+  }
+  batchSizes.push_back(batch.size());
+}
+
+template <typename Label_t>
+void QueryServer<Label_t>::AcceptLoop() {
+  pollfd pfd{listenFd, POLLIN, 0};
+  while (true) {
+    {
+      std::lock_guard<std::mutex> guard(queueLock);
+      if (stopping) {
+        return;
+      }
+    }
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    auto conn = std::make_shared<Connection>();
+    conn->fd = fd;
+
+    std::lock_guard<std::mutex> guard(readersLock);
+    connections.push_back(conn);
+    activeReaders++;
+    std::thread(&QueryServer<Label_t>::ReadLoop, this, conn).detach();
+  }
+}
+
+template <typename Label_t>
+void QueryServer<Label_t>::ReadLoop(std::shared_ptr<Connection> conn) {
+  ReadRequests(conn);
+
+  std::unique_lock<std::mutex> lock(readersLock);
+  connections.erase(std::find(connections.begin(), connections.end(), conn));
+  conn.reset();
+  activeReaders--;
+  // Stop may destroy the server once no reader is active, so the lock is released and Stop woken
+  // only after this thread is done with it.
+  std::notify_all_at_thread_exit(readersCv, std::move(lock));
+}
+
+template <typename Label_t>
+void QueryServer<Label_t>::ReadRequests(const std::shared_ptr<Connection>& conn) {
+  while (true) {
+    uint32_t nnz;
+    if (!ReadFully(conn->fd, &nnz, sizeof(uint32_t))) {
+      return;
+    }
+    if (nnz == ShutdownRequest) {
+      std::lock_guard<std::mutex> guard(queueLock);
+      stopping = true;
+      queueCv.notify_all();
+      return;
+    }
+    if (nnz > maxNnz) {
+      LOG << "Closing connection that sent a request of " << nnz << " nonzeros, above the max of "
+          << maxNnz << std::endl;
+      return;
+    }
+
+    PendingQuery query;
+    query.conn = conn;
+    query.indices.resize(nnz);
+    query.values.resize(nnz);
+    if (!ReadFully(conn->fd, query.indices.data(), nnz * sizeof(uint32_t)) ||
+        !ReadFully(conn->fd, query.values.data(), nnz * sizeof(float))) {
+      return;
+    }
+    query.arrival = Clock::now();
+
+    std::lock_guard<std::mutex> guard(queueLock);
+    queue.push_back(std::move(query));
+    if (queue.size() == 1 || queue.size() >= maxBatch) {
+      queueCv.notify_all();
+    }
+  }
+}
+
+template <typename Label_t>
+void QueryServer<Label_t>::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(queueLock);
+    stopping = true;
+    queueCv.notify_all();
+  }
+  if (acceptor.joinable()) {
+    acceptor.join();
+  }
+
+  // Unblocks the readers still waiting on a client, each of which drops its connection.
+  std::unique_lock<std::mutex> lock(readersLock);
+  for (auto& conn : connections) {
+    shutdown(conn->fd, SHUT_RDWR);
+  }
+  readersCv.wait(lock, [this] { return activeReaders == 0; });
+  lock.unlock();
+
+  if (listenFd >= 0) {
+    close(listenFd);
+    unlink(socketPath.c_str());
+    listenFd = -1;
+  }
+}
+
+template <typename Label_t>
+QueryServer<Label_t>::~QueryServer() { Stop(); }
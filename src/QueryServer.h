@@ -0,0 +1,129 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Slash.h"
+
+/*
+ * Wire protocol, all fields in host byte order:
+ *   request:  uint32_t nnz | uint32_t indices[nnz] | float values[nnz]
+ *   response: uint32_t len | Label_t labels[len]
+ * where Label_t is the label type of the index, 4 or 8 bytes.
+ * A request with nnz == ShutdownRequest stops the server once pending queries are answered.
+ */
+constexpr uint32_t ShutdownRequest = UINT32_MAX;
+
+// Largest nnz a request may declare before its connection is closed, bounding what it allocates.
+constexpr uint64_t DefaultMaxRequestNnz = 1 << 20;
+
+bool ReadFully(int fd, void* buf, uint64_t len);
+
+// Writes to a socket, returning false rather than raising SIGPIPE if the peer has gone away.
+bool WriteFully(int fd, const void* buf, uint64_t len);
+
+// Throws std::runtime_error if the socket cannot be connected.
+int ConnectUnixSocket(const std::string& path);
+
+class LatencyStats {
+ public:
+  void Record(double micros) { samples.push_back(micros); }
+
+  void Merge(const LatencyStats& other) {
+    samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+  }
+
+  uint64_t Count() const { return samples.size(); }
+
+  double Percentile(double p);
+
+  void Log(const std::string& name, double elapsedSeconds, const std::string& unit = "queries");
+
+ private:
+  std::vector<double> samples;
+};
+
+template <typename Label_t>
+class QueryServer {
+ public:
+  /*
+   * With a non zero deadlineMicros each batch is answered with an anytime query that stops
+   * visiting tables once its oldest query has been waiting for deadlineMicros. A request with
+   * more than maxNnz nonzeros closes its connection.
+   */
+  QueryServer(Slash<Label_t>& _slash, std::string _socketPath, uint64_t _maxBatch,
+              uint64_t _maxWaitMicros, uint64_t _topk, uint64_t _deadlineMicros = 0,
+              uint64_t _maxNnz = DefaultMaxRequestNnz);
+
+  QueryServer(const QueryServer& other) = delete;
+  QueryServer& operator=(const QueryServer& other) = delete;
+
+  void Run();
+
+  ~QueryServer();
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  // Closed once its reader has returned and every pending query on it has been answered.
+  struct Connection {
+    int fd;
+    std::mutex writeLock;
+    bool broken = false;  // Set under writeLock once a response fails to go out.
+
+    ~Connection() { close(fd); }
+  };
+
+  struct PendingQuery {
+    std::shared_ptr<Connection> conn;
+    std::vector<uint32_t> indices;
+    std::vector<float> values;
+    Clock::time_point arrival;
+  };
+
+  void AcceptLoop();
+
+  // Runs on a detached thread per connection, which drops the connection when the client
+  // disconnects or sends a bad request.
+  void ReadLoop(std::shared_ptr<Connection> conn);
+
+  void ReadRequests(const std::shared_ptr<Connection>& conn);
+
+  void ProcessBatch(std::vector<PendingQuery>& batch);
+
+  void Stop();
+
+  Slash<Label_t>& slash;
+  std::string socketPath;
+  uint64_t maxBatch, maxWaitMicros, topk, deadlineMicros, maxNnz;
+  int listenFd;
+
+  std::mutex queueLock;
+  std::condition_variable queueCv;
+  std::deque<PendingQuery> queue;
+  bool stopping;
+
+  std::thread acceptor;
+  std::mutex readersLock;
+  std::condition_variable readersCv;
+  uint64_t activeReaders = 0;
+  std::vector<std::shared_ptr<Connection>> connections;
+
+  std::vector<uint32_t> batchIndices;
+  std::vector<uint64_t> batchMarkers;
+  std::vector<float> batchValues;
+  QueryResult<Label_t> results;
+  std::vector<uint64_t> tablesUsed;
+  uint64_t totalTablesUsed = 0;
+
+  LatencyStats latencies;
+  std::vector<uint64_t> batchSizes;
+};
@@ -0,0 +1,198 @@
+#include "ResultFile.h"
+
+#include <cstring>
+#include <stdexcept>
+
+static const char ResultMagic[4] = {'S', 'L', 'Q', 'R'};
+static const char GraphMagic[4] = {'S', 'L', 'K', 'G'};
+
+// Offset of numQueries in the header.
+constexpr uint64_t NumQueriesOffset = sizeof(ResultMagic) + sizeof(uint32_t) + sizeof(uint64_t);
+
+template class QueryResultWriter<uint32_t>;
+template class QueryResultWriter<uint64_t>;
+template class QueryResultReader<uint32_t>;
+template class QueryResultReader<uint64_t>;
+template class KnnGraphWriter<uint32_t>;
+template class KnnGraphWriter<uint64_t>;
+template class KnnGraphReader<uint32_t>;
+template class KnnGraphReader<uint64_t>;
+
+template <typename T>
+static void WriteValue(std::ofstream& file, T value) {
+  file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static T ReadValue(std::ifstream& file) {
+  T value = 0;
+  file.read(reinterpret_cast<char*>(&value), sizeof(T));
+  return value;
+}
+
+template <typename Label_t>
+QueryResultWriter<Label_t>::QueryResultWriter(const std::string& filename, uint64_t topk)
+    : file(filename, std::ios::binary | std::ios::trunc) {
+  if (!file) {
+    throw std::runtime_error("Unable to create result file " + filename);
+  }
+  file.write(ResultMagic, sizeof(ResultMagic));
+  WriteValue<uint32_t>(file, sizeof(Label_t));
+  WriteValue<uint64_t>(file, topk);
+  WriteValue<uint64_t>(file, 0);
+}
+
+template <typename Label_t>
+void QueryResultWriter<Label_t>::Append(const QueryResult<std::pair<Label_t, uint32_t>>& results) {
+  // Serialized into one buffer so that a chunk is a single write.
+  constexpr uint64_t EntryBytes = sizeof(Label_t) + sizeof(uint32_t);
+  uint64_t bytes = 0;
+  for (uint64_t q = 0; q < results.len(); q++) {
+    bytes += sizeof(uint32_t) + results.len(q) * EntryBytes;
+  }
+  buffer.resize(bytes);
+
+  char* out = buffer.data();
+  for (uint64_t q = 0; q < results.len(); q++) {
+    uint32_t len = results.len(q);
+    std::memcpy(out, &len, sizeof(uint32_t));
+    out += sizeof(uint32_t);
+    for (uint64_t i = 0; i < len; i++) {
+      std::memcpy(out, &results[q][i].first, sizeof(Label_t));
+      std::memcpy(out + sizeof(Label_t), &results[q][i].second, sizeof(uint32_t));
+      out += EntryBytes;
+    }
+  }
+  file.write(buffer.data(), bytes);
+  numQueries += results.len();
+}
+
+template <typename Label_t>
+void QueryResultWriter<Label_t>::Close() {
+  if (!file.is_open()) {
+    return;
+  }
+  file.seekp(NumQueriesOffset);
+  WriteValue<uint64_t>(file, numQueries);
+  file.close();
+}
+
+template <typename Label_t>
+QueryResultReader<Label_t>::QueryResultReader(const std::string& _filename)
+    : file(_filename, std::ios::binary), filename(_filename) {
+  char magic[sizeof(ResultMagic)] = {};
+  file.read(magic, sizeof(magic));
+  if (!file || std::memcmp(magic, ResultMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error(filename + " is not a result file");
+  }
+  uint32_t labelBytes = ReadValue<uint32_t>(file);
+  if (labelBytes != sizeof(Label_t)) {
+    throw std::runtime_error(filename + " has " + std::to_string(labelBytes * 8) +
+                             " bit labels, expected " + std::to_string(sizeof(Label_t) * 8));
+  }
+  topk = ReadValue<uint64_t>(file);
+  numQueries = ReadValue<uint64_t>(file);
+}
+
+template <typename Label_t>
+uint64_t QueryResultReader<Label_t>::Next(uint64_t n, QueryResult<Label_t>& result) {
+  n = std::min(n, numQueries - numRead);
+  result.Reset(n, topk);
+  for (uint64_t q = 0; q < n; q++) {
+    uint32_t len = ReadValue<uint32_t>(file);
+    if (!file || len > topk) {
+      throw std::runtime_error("Truncated or corrupt result file " + filename);
+    }
+    for (uint32_t i = 0; i < len; i++) {
+      result[q][i] = ReadValue<Label_t>(file);
+      ReadValue<uint32_t>(file);
+    }
+    result.len(q) = len;
+  }
+  numRead += n;
+  return n;
+}
+
+template <typename Label_t>
+KnnGraphWriter<Label_t>::KnnGraphWriter(const std::string& filename, uint64_t k)
+    : file(filename, std::ios::binary | std::ios::trunc) {
+  if (!file) {
+    throw std::runtime_error("Unable to create graph file " + filename);
+  }
+  file.write(GraphMagic, sizeof(GraphMagic));
+  WriteValue<uint32_t>(file, sizeof(Label_t));
+  WriteValue<uint64_t>(file, k);
+  WriteValue<uint64_t>(file, 0);
+  WriteValue<uint64_t>(file, 0);
+}
+
+template <typename Label_t>
+void KnnGraphWriter<Label_t>::Append(uint64_t n, const Label_t* rows, const uint64_t* offsets,
+                                     const Label_t* neighbours, const uint32_t* counts) {
+  uint64_t edges = offsets[n] - offsets[0];
+  buffer.resize(n * (sizeof(Label_t) + sizeof(uint32_t)) +
+                edges * (sizeof(Label_t) + sizeof(uint32_t)));
+
+  char* out = buffer.data();
+  for (uint64_t i = 0; i < n; i++) {
+    uint32_t degree = offsets[i + 1] - offsets[i];
+    std::memcpy(out, rows + i, sizeof(Label_t));
+    std::memcpy(out + sizeof(Label_t), &degree, sizeof(uint32_t));
+    out += sizeof(Label_t) + sizeof(uint32_t);
+    std::memcpy(out, neighbours + offsets[i], degree * sizeof(Label_t));
+    out += degree * sizeof(Label_t);
+    std::memcpy(out, counts + offsets[i], degree * sizeof(uint32_t));
+    out += degree * sizeof(uint32_t);
+  }
+  file.write(buffer.data(), buffer.size());
+  numRows += n;
+  numEdges += edges;
+}
+
+template <typename Label_t>
+void KnnGraphWriter<Label_t>::Close() {
+  if (!file.is_open()) {
+    return;
+  }
+  file.seekp(sizeof(GraphMagic) + sizeof(uint32_t) + sizeof(uint64_t));
+  WriteValue<uint64_t>(file, numRows);
+  WriteValue<uint64_t>(file, numEdges);
+  file.close();
+}
+
+template <typename Label_t>
+KnnGraphReader<Label_t>::KnnGraphReader(const std::string& _filename)
+    : file(_filename, std::ios::binary), filename(_filename) {
+  char magic[sizeof(GraphMagic)] = {};
+  file.read(magic, sizeof(magic));
+  if (!file || std::memcmp(magic, GraphMagic, sizeof(magic)) != 0) {
+    throw std::runtime_error(filename + " is not a graph file");
+  }
+  uint32_t labelBytes = ReadValue<uint32_t>(file);
+  if (labelBytes != sizeof(Label_t)) {
+    throw std::runtime_error(filename + " has " + std::to_string(labelBytes * 8) +
+                             " bit labels, expected " + std::to_string(sizeof(Label_t) * 8));
+  }
+  k = ReadValue<uint64_t>(file);
+  numRows = ReadValue<uint64_t>(file);
+  numEdges = ReadValue<uint64_t>(file);
+}
+
+template <typename Label_t>
+bool KnnGraphReader<Label_t>::Next(Label_t& row, std::vector<Label_t>& neighbours,
+                                   std::vector<uint32_t>& counts) {
+  if (numRead == numRows) {
+    return false;
+  }
+  row = ReadValue<Label_t>(file);
+  uint32_t degree = ReadValue<uint32_t>(file);
+  neighbours.resize(degree);
+  counts.resize(degree);
+  file.read(reinterpret_cast<char*>(neighbours.data()), degree * sizeof(Label_t));
+  file.read(reinterpret_cast<char*>(counts.data()), degree * sizeof(uint32_t));
+  if (!file) {
+    throw std::runtime_error("Truncated or corrupt graph file " + filename);
+  }
+  numRead++;
+  return true;
+}
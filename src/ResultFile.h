@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "HashTable.h"
+
+/*
+ * Binary top k results, all fields in host byte order:
+ *   header:    char magic[4] = "SLQR" | uint32_t labelBytes | uint64_t topk | uint64_t numQueries
+ *   per query: uint32_t len | len x (Label_t label, uint32_t count)
+ * where count is the number of tables in which the label collided with the query, sorted by
+ * decreasing count. Queries are appended in order, and numQueries is filled in on close.
+ */
+template <typename Label_t>
+class QueryResultWriter {
+ public:
+  // Throws std::runtime_error if the file cannot be created.
+  QueryResultWriter(const std::string& filename, uint64_t topk);
+
+  QueryResultWriter(const QueryResultWriter& other) = delete;
+  QueryResultWriter& operator=(const QueryResultWriter& other) = delete;
+
+  void Append(const QueryResult<std::pair<Label_t, uint32_t>>& results);
+
+  uint64_t NumQueries() const { return numQueries; }
+
+  // Writes numQueries to the header and closes the file, called by the destructor if needed.
+  void Close();
+
+  ~QueryResultWriter() { Close(); }
+
+ private:
+  std::ofstream file;
+  std::vector<char> buffer;
+  uint64_t numQueries = 0;
+};
+
+template <typename Label_t>
+class QueryResultReader {
+ public:
+  // Throws std::runtime_error if the file is missing, is not a result file or has other labels.
+  QueryResultReader(const std::string& filename);
+
+  uint64_t TopK() const { return topk; }
+
+  uint64_t NumQueries() const { return numQueries; }
+
+  // Reads the labels of the next min(n, remaining) queries into result, returning that count.
+  uint64_t Next(uint64_t n, QueryResult<Label_t>& result);
+
+ private:
+  std::ifstream file;
+  std::string filename;
+  uint64_t topk, numQueries, numRead = 0;
+};
+
+/*
+ * Binary k nearest neighbour graph, all fields in host byte order:
+ *   header:  char magic[4] = "SLKG" | uint32_t labelBytes | uint64_t k | uint64_t numRows |
+ *            uint64_t numEdges
+ *   per row: Label_t label | uint32_t degree | degree x Label_t neighbour |
+ *            degree x uint32_t count
+ * where count is the number of tables in which the two rows collide, and the neighbours of a row
+ * are sorted by decreasing count. numRows and numEdges are filled in on close.
+ */
+template <typename Label_t>
+class KnnGraphWriter {
+ public:
+  // Throws std::runtime_error if the file cannot be created.
+  KnnGraphWriter(const std::string& filename, uint64_t k);
+
+  KnnGraphWriter(const KnnGraphWriter& other) = delete;
+  KnnGraphWriter& operator=(const KnnGraphWriter& other) = delete;
+
+  // Appends n rows in CSR form, row i having neighbours [offsets[i], offsets[i + 1]).
+  void Append(uint64_t n, const Label_t* rows, const uint64_t* offsets, const Label_t* neighbours,
+              const uint32_t* counts);
+
+  uint64_t NumRows() const { return numRows; }
+
+  uint64_t NumEdges() const { return numEdges; }
+
+  // Writes numRows and numEdges to the header and closes the file, called by the destructor.
+  void Close();
+
+  ~KnnGraphWriter() { Close(); }
+
+ private:
+  std::ofstream file;
+  std::vector<char> buffer;
+  uint64_t numRows = 0, numEdges = 0;
+};
+
+template <typename Label_t>
+class KnnGraphReader {
+ public:
+  // Throws std::runtime_error if the file is missing, is not a graph file or has other labels.
+  KnnGraphReader(const std::string& filename);
+
+  uint64_t K() const { return k; }
+
+  uint64_t NumRows() const { return numRows; }
+
+  uint64_t NumEdges() const { return numEdges; }
+
+  // Reads the next row, returning false once every row has been read.
+  bool Next(Label_t& row, std::vector<Label_t>& neighbours, std::vector<uint32_t>& counts);
+
+ private:
+  std::ifstream file;
+  std::string filename;
+  uint64_t k, numRows, numEdges, numRead = 0;
+};
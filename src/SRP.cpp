@@ -0,0 +1,199 @@
+#include "SRP.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "Scratch.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * One SIMD register of floats, so that the projection kernel is written once for AVX-512, AVX2
+ * with FMA, and plain scalar code.
+ */
+#if defined(__AVX512F__)
+struct Simd {
+  using Reg = __m512;
+  static constexpr uint64_t Width = 16;
+  static Reg Zero() { return _mm512_setzero_ps(); }
+  static Reg Load(const float* p) { return _mm512_loadu_ps(p); }
+  static Reg Set1(float x) { return _mm512_set1_ps(x); }
+  static Reg Fma(Reg a, Reg b, Reg c) { return _mm512_fmadd_ps(a, b, c); }
+  static void Store(float* p, Reg r) { _mm512_storeu_ps(p, r); }
+};
+#elif defined(__AVX2__) && defined(__FMA__)
+struct Simd {
+  using Reg = __m256;
+  static constexpr uint64_t Width = 8;
+  static Reg Zero() { return _mm256_setzero_ps(); }
+  static Reg Load(const float* p) { return _mm256_loadu_ps(p); }
+  static Reg Set1(float x) { return _mm256_set1_ps(x); }
+  static Reg Fma(Reg a, Reg b, Reg c) { return _mm256_fmadd_ps(a, b, c); }
+  static void Store(float* p, Reg r) { _mm256_storeu_ps(p, r); }
+};
+#else
+struct Simd {
+  using Reg = float;
+  static constexpr uint64_t Width = 1;
+  static Reg Zero() { return 0; }
+  static Reg Load(const float* p) { return *p; }
+  static Reg Set1(float x) { return x; }
+  static Reg Fma(Reg a, Reg b, Reg c) { return a * b + c; }
+  static void Store(float* p, Reg r) { *p = r; }
+};
+#endif
+
+// Registers of outputs per row and rows accumulated together by ProjectBlock.
+constexpr uint64_t TileRegs = 2;
+constexpr uint64_t BlockRows = 4;
+constexpr uint64_t TileWidth = TileRegs * Simd::Width;
+
+SRP::SRP(uint64_t _K, uint64_t _L, uint64_t _rangePow, uint64_t _dim)
+    : K(_K), L(_L), rangePow(_rangePow), dim(_dim), numPlanes(_K * _L) {
+  if (K == 0 || K > 32 || rangePow == 0 || rangePow > 32) {
+    throw std::invalid_argument("SRP requires 0 < K <= 32 and 0 < range_pow <= 32");
+  }
+  stride = (numPlanes + TileWidth - 1) / TileWidth * TileWidth;
+  planes.resize(dim * stride);
+
+  // Fixed seeds so that every rank draws the same hyperplanes.
+  std::mt19937 rng(13);
+  std::normal_distribution<float> normal;
+  for (uint64_t m = 0; m < numPlanes; m++) {
+    for (uint64_t j = 0; j < dim; j++) {
+      planes[j * stride + m] = normal(rng);
+    }
+  }
+  for (uint64_t t = 0; t < L; t++) {
+    tableSeeds.push_back(rng() | 1);
+  }
+}
+
+template <uint64_t Rows>
+void SRP::ProjectBlock(const float* const* rows, float* const* projections, uint64_t tile) const {
+  typename Simd::Reg acc[Rows][TileRegs];
+  for (uint64_t r = 0; r < Rows; r++) {
+    for (uint64_t i = 0; i < TileRegs; i++) {
+      acc[r][i] = Simd::Zero();
+    }
+  }
+
+  const float* column = planes.data() + tile;
+  for (uint64_t j = 0; j < dim; j++, column += stride) {
+    typename Simd::Reg w[TileRegs];
+    for (uint64_t i = 0; i < TileRegs; i++) {
+      w[i] = Simd::Load(column + i * Simd::Width);
+    }
+    for (uint64_t r = 0; r < Rows; r++) {
+      typename Simd::Reg x = Simd::Set1(rows[r][j]);
+      for (uint64_t i = 0; i < TileRegs; i++) {
+        acc[r][i] = Simd::Fma(x, w[i], acc[r][i]);
+      }
+    }
+  }
+
+  for (uint64_t r = 0; r < Rows; r++) {
+    for (uint64_t i = 0; i < TileRegs; i++) {
+      Simd::Store(projections[r] + tile + i * Simd::Width, acc[r][i]);
+    }
+  }
+}
+
+void SRP::ProjectPanel(const float* const* rows, float* const* projections, uint64_t n) const {
+  // Tiles outermost, so that the dim x TileWidth slice of the planes is reused by every row.
+  for (uint64_t tile = 0; tile < stride; tile += TileWidth) {
+    uint64_t r = 0;
+    for (; r + BlockRows <= n; r += BlockRows) {
+      ProjectBlock<BlockRows>(rows + r, projections + r, tile);
+    }
+    for (; r < n; r++) {
+      ProjectBlock<1>(rows + r, projections + r, tile);
+    }
+  }
+}
+
+void SRP::ProjectSparse(const uint32_t* indices, const float* values, uint64_t len,
+                        float* projections) const {
+  std::fill(projections, projections + stride, 0.0f);
+  for (uint64_t i = 0; i < len; i++) {
+    const float* row = planes.data() + indices[i] * stride;
+    float x = values[i];
+    for (uint64_t m = 0; m < stride; m++) {
+      projections[m] += x * row[m];
+    }
+  }
+}
+
+void SRP::Buckets(const float* projections, uint32_t* hashes, uint64_t probes) const {
+  uint32_t order[32];
+  for (uint64_t t = 0; t < L; t++) {
+    const float* proj = projections + t * K;
+    uint32_t signature = 0;
+    for (uint64_t k = 0; k < K; k++) {
+      signature |= (uint32_t)(proj[k] > 0) << k;
+    }
+    auto bucket = [&](uint32_t sig) { return (uint32_t)(sig * tableSeeds[t]) >> (32 - rangePow); };
+    hashes[t * probes] = bucket(signature);
+    if (probes == 1) {
+      continue;
+    }
+
+    uint64_t flips = std::min<uint64_t>(probes - 1, K);
+    for (uint32_t k = 0; k < K; k++) {
+      order[k] = k;
+    }
+    std::partial_sort(order, order + flips, order + K, [proj](uint32_t a, uint32_t b) {
+      return std::abs(proj[a]) < std::abs(proj[b]);
+    });
+    for (uint64_t p = 1; p < probes; p++) {
+      uint32_t flipped = p <= flips ? signature ^ (1u << order[p - 1]) : signature;
+      hashes[t * probes + p] = bucket(flipped);
+    }
+  }
+}
+
+void SRP::Hash(const CsrView& batch, uint64_t offset, uint64_t num, uint32_t* hashes,
+               uint64_t probes) {
+  for (uint64_t row = offset; row < offset + num; row++) {
+    const uint32_t* indices = batch.Indices(row);
+    uint64_t len = batch.Len(row);
+    if (len > 0 && *std::max_element(indices, indices + len) >= dim) {
+      throw std::out_of_range("Row " + std::to_string(row) + " has an index beyond SRP dim " +
+                              std::to_string(dim));
+    }
+  }
+
+  uint64_t numPanels = (num + SrpPanelRows - 1) / SrpPanelRows;
+
+#pragma omp parallel for default(none) shared(batch, offset, num, hashes, probes, numPanels) \
+    schedule(dynamic, 1)
+  for (uint64_t panel = 0; panel < numPanels; panel++) {
+    float* projections = ThreadScratch<float, Scratch::Projections>(SrpPanelRows * stride).data();
+    const float* denseRows[SrpPanelRows];
+    float* denseProjections[SrpPanelRows];
+    uint64_t numDense = 0;
+
+    uint64_t start = offset + panel * SrpPanelRows;
+    uint64_t end = std::min(offset + num, start + SrpPanelRows);
+    for (uint64_t row = start; row < end; row++) {
+      float* rowProjections = projections + (row - start) * stride;
+      // Indices are sorted and unique, so a row of dim entries is dense.
+      if (blocked && batch.Len(row) == dim) {
+        denseRows[numDense] = batch.Values(row);
+        denseProjections[numDense++] = rowProjections;
+      } else {
+        ProjectSparse(batch.Indices(row), batch.Values(row), batch.Len(row), rowProjections);
+      }
+    }
+    ProjectPanel(denseRows, denseProjections, numDense);
+
+    for (uint64_t row = start; row < end; row++) {
+      Buckets(projections + (row - start) * stride, hashes + (row - offset) * L * probes, probes);
+    }
+  }
+}
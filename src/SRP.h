@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "DataLoader.h"
+#include "Hasher.h"
+
+// Rows projected together by SRP, sized so that a panel and a tile of the projection stay in cache.
+constexpr uint64_t SrpPanelRows = 32;
+
+/*
+ * Signed random projections (SimHash), for dense float vectors compared by cosine similarity.
+ * Each table has K hyperplanes with independent standard normal components, bit k of its
+ * signature is set when the vector lies on the positive side of hyperplane k, and the K bit
+ * signature is mixed into a rangePow bit bucket id. Extra probes flip the signature bits whose
+ * projections are closest to zero first. Requires K <= 32 and rangePow <= 32.
+ *
+ * Vectors are CSR rows with indices below dim. Rows with all dim entries go through a blocked
+ * matrix multiply: a tile of the projection matrix is kept in cache across a panel of
+ * SrpPanelRows rows, and a block of rows by a tile of outputs is accumulated in registers, using
+ * AVX-512 or AVX2 with FMA when the build targets them. Sparser rows add up one row of the
+ * projection matrix per nonzero.
+ */
+class SRP : public Hasher {
+ public:
+  SRP(uint64_t _K, uint64_t _L, uint64_t _rangePow, uint64_t _dim);
+
+  // Throws std::out_of_range if a row has an index of dim or more.
+  void Hash(const CsrView& batch, uint64_t offset, uint64_t num, uint32_t* hashes,
+            uint64_t probes = 1) override;
+
+  uint64_t NumTables() const override { return L; }
+
+  uint64_t RangePow() const override { return rangePow; }
+
+  uint64_t Dim() const { return dim; }
+
+  // Disabling projects every row one nonzero at a time, for benchmarking.
+  void SetBlocked(bool enabled) { blocked = enabled; }
+
+ private:
+  uint64_t K, L, rangePow, dim, numPlanes, stride;
+
+  // Row j holds component j of every hyperplane, zero padded to stride columns.
+  std::vector<float> planes;
+  std::vector<uint32_t> tableSeeds;
+  bool blocked = true;
+
+  template <uint64_t Rows>
+  void ProjectBlock(const float* const* rows, float* const* projections, uint64_t tile) const;
+
+  // Projections of n <= SrpPanelRows dense rows.
+  void ProjectPanel(const float* const* rows, float* const* projections, uint64_t n) const;
+
+  void ProjectSparse(const uint32_t* indices, const float* values, uint64_t len,
+                     float* projections) const;
+
+  void Buckets(const float* projections, uint32_t* hashes, uint64_t probes) const;
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <vector>
+
+// Every user of a scratch buffer needs its own tag, since buffers are shared per (type, tag).
+enum class Scratch {
+  MinHashBins,
+  MinHashes,
+  SecondMinHashBins,
+  SecondMinHashes,
+  ProbeComponents,
+  TableIndices,
+  HashChunks,
+  BatchHashes,
+  Candidates,
+  CandidateCounts,
+  BucketSlots,
+  BlockVisits,
+  BlockStarts,
+  BlockCandidates,
+  TopK,
+  Projections
+};
+
+/*
+ * Returns a per thread buffer of at least size elements that persists across calls, so that hot
+ * loops running on the OpenMP thread pool can reuse their working memory instead of allocating.
+ */
+template <typename T, Scratch Tag>
+std::vector<T>& ThreadScratch(uint64_t size = 0) {
+  static thread_local std::vector<T> buffer;
+  if (buffer.size() < size) {
+    buffer.resize(size);
+  }
+  return buffer;
+}
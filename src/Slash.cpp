@@ -2,56 +2,496 @@
 
 #include <mpi.h>
 
+#include <algorithm>
 #include <chrono>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 
 #include "DataLoader.h"
 #include "DistributedLog.h"
+#include "ResultFile.h"
+#include "Scratch.h"
 
-Slash::Slash(uint64_t K, uint64_t L, uint64_t range_pow, uint64_t reservoir_size) {
-  hasher = new DOPH<uint32_t, uint32_t>(K, L, range_pow);
-  hash_tables = new HashTable<uint32_t, uint32_t>(L, reservoir_size, range_pow);
+template class Slash<uint32_t>;
+template class Slash<uint64_t>;
+
+template <typename T>
+MPI_Datatype MpiType();
+
+template <>
+MPI_Datatype MpiType<uint32_t>() {
+  return MPI_UINT32_T;
+}
+
+template <>
+MPI_Datatype MpiType<uint64_t>() {
+  return MPI_UINT64_T;
+}
+
+// Largest number of elements passed to one MPI call, whose counts are ints.
+constexpr uint64_t MaxMpiCount = 1ULL << 30;
+
+/*
+ * Point to point transfers of any length, split into messages of at most MaxMpiCount elements.
+ * Both ends must agree on the count, and messages of one tag between two ranks arrive in order.
+ */
+template <typename T>
+static void SendChunked(const T* buf, uint64_t count, int dest, int tag) {
+  for (uint64_t off = 0; off < count; off += MaxMpiCount) {
+    MPI_Send(buf + off, std::min(MaxMpiCount, count - off), MpiType<T>(), dest, tag,
+             MPI_COMM_WORLD);
+  }
+}
+
+template <typename T>
+static void RecvChunked(T* buf, uint64_t count, int source, int tag) {
+  for (uint64_t off = 0; off < count; off += MaxMpiCount) {
+    MPI_Recv(buf + off, std::min(MaxMpiCount, count - off), MpiType<T>(), source, tag,
+             MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+  }
 }
 
-void Slash::InsertSVM(std::string datafile, uint64_t N, uint64_t offset, uint64_t avg_dim,
-                      uint64_t batch_size) {
+// Sends sendCount elements to dest while receiving recvCount from source, as MPI_Sendrecv.
+template <typename T>
+static void SendrecvChunked(const T* sendBuf, uint64_t sendCount, int dest, T* recvBuf,
+                            uint64_t recvCount, int source, int tag) {
+  std::vector<MPI_Request> requests;
+  for (uint64_t off = 0; off < recvCount; off += MaxMpiCount) {
+    requests.emplace_back();
+    MPI_Irecv(recvBuf + off, std::min(MaxMpiCount, recvCount - off), MpiType<T>(), source, tag,
+              MPI_COMM_WORLD, &requests.back());
+  }
+  for (uint64_t off = 0; off < sendCount; off += MaxMpiCount) {
+    requests.emplace_back();
+    MPI_Isend(sendBuf + off, std::min(MaxMpiCount, sendCount - off), MpiType<T>(), dest, tag,
+              MPI_COMM_WORLD, &requests.back());
+  }
+  MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+}
+
+template <typename Label_t>
+Slash<Label_t>::Slash(uint64_t K, uint64_t L, uint64_t range_pow, uint64_t reservoir_size,
+                      bool concurrent)
+    : Slash(new DOPH<Label_t, uint32_t>(K, L, range_pow), reservoir_size, concurrent) {}
+
+template <typename Label_t>
+Slash<Label_t>::Slash(Hasher* _hasher, uint64_t reservoir_size, bool concurrent)
+    : hasher(_hasher) {
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &world_size);
 
-  uint64_t base_n = N / world_size;
-  uint64_t local_n = base_n;
-  if (static_cast<uint64_t>(rank) < N % world_size) {
-    local_n++;
-  }
-  uint64_t local_offset = base_n * rank + std::min<uint64_t>(rank, N % world_size);
+  hash_tables = new HashTable<Label_t, uint32_t>(hasher->NumTables(), reservoir_size,
+                                                 hasher->RangePow(), DefaultMaxRand, concurrent);
+}
+
+template <typename Label_t>
+const uint32_t* Slash<Label_t>::HashBatch(const CsrView& data, uint64_t offset, uint64_t num,
+                                          uint64_t probes) {
+  // Per calling thread so that concurrent inserts and queries do not share a hash buffer.
+  uint32_t* hashes =
+      ThreadScratch<uint32_t, Scratch::BatchHashes>(num * hasher->NumTables() * probes).data();
+  hasher->Hash(data, offset, num, hashes, probes);
+  return hashes;
+}
+
+template <typename Label_t>
+void Slash<Label_t>::InsertSVM(std::string datafile, uint64_t N, uint64_t offset,
+                               uint64_t avg_dim, uint64_t batch_size, Partition partition) {
+  auto bounds = PartitionRows(datafile, N, offset, partition);
+  uint64_t local_offset = bounds[rank];
+  uint64_t local_n = bounds[rank + 1] - bounds[rank];
 
   LOG << "Inserting: local_n = " << local_n << " local_offset = " << local_offset << std::endl;
-  auto dataset = SvmDataset<uint32_t>::ReadSvmDataset(datafile, local_offset, local_n, avg_dim,
-                                                      local_offset + offset);
+  auto dataset = SvmDataset<Label_t>::ReadSvmDataset(datafile, (Label_t)local_offset, local_n,
+                                                     avg_dim, local_offset + offset);
 
-  uint64_t num_batches = (local_n + batch_size - 1) / batch_size;
+  InsertTimes times;
+  if (dataset.IsSequentiallyLabeled()) {
+    times = InsertBatches(dataset.View(), nullptr, dataset.start, batch_size);
+  } else {
+    times = InsertBatches(dataset.View(), dataset.labels, 0, batch_size);
+  }
+  LogPartition(bounds, dataset.markers[local_n], times, partition);
+}
+
+// Tags of the messages that carry one batch of rows from a reader in InsertSVMScatter.
+constexpr int ScatterMarkersTag = 1;
+constexpr int ScatterIndicesTag = 2;
+constexpr int ScatterValuesTag = 3;
+
+/*
+ * One batch of rows received by InsertSVMScatter. Markers arrive first, since they give the
+ * number of nonzeros to receive.
+ */
+struct ScatterBatch {
+  std::vector<uint64_t> markers;
+  std::vector<uint32_t> indices;
+  std::vector<float> values;
+  MPI_Request markers_request, data_requests[2];
+  bool data_posted;
+
+  void PostMarkers(uint64_t n, MPI_Comm group) {
+    markers.resize(n + 1);
+    data_posted = false;
+    MPI_Irecv(markers.data(), n + 1, MPI_UINT64_T, 0, ScatterMarkersTag, group, &markers_request);
+  }
+
+  // Posts the receives of the nonzeros once the markers have arrived, waiting for them if wait.
+  void PostData(MPI_Comm group, bool wait) {
+    int arrived = 1;
+    if (wait) {
+      MPI_Wait(&markers_request, MPI_STATUS_IGNORE);
+    } else {
+      MPI_Test(&markers_request, &arrived, MPI_STATUS_IGNORE);
+    }
+    if (!arrived || data_posted) {
+      return;
+    }
+    uint64_t nnz = markers.back();
+    indices.resize(nnz);
+    values.resize(nnz);
+    MPI_Irecv(indices.data(), nnz, MPI_UINT32_T, 0, ScatterIndicesTag, group, &data_requests[0]);
+    MPI_Irecv(values.data(), nnz, MPI_FLOAT, 0, ScatterValuesTag, group, &data_requests[1]);
+    data_posted = true;
+  }
+
+  CsrView Wait(MPI_Comm group) {
+    PostData(group, true);
+    MPI_Waitall(2, data_requests, MPI_STATUSES_IGNORE);
+    return {markers.size() - 1, indices.data(), values.data(), markers.data()};
+  }
+};
+
+template <typename Label_t>
+void Slash<Label_t>::InsertSVMScatter(std::string datafile, uint64_t N, uint64_t offset,
+                                      uint64_t avg_dim, uint64_t batch_size, Partition partition,
+                                      bool reader_per_node) {
+  auto bounds = PartitionRows(datafile, N, offset, partition);
+  uint64_t local_offset = bounds[rank];
+  uint64_t local_n = bounds[rank + 1] - bounds[rank];
+  auto batch_rows = [&](int r, uint64_t b) {
+    return std::min(bounds[r + 1] - bounds[r], (b + 1) * batch_size) - b * batch_size;
+  };
+
+  // The reader is rank 0 of the group, since the group ranks follow the world ranks.
+  MPI_Comm group;
+  if (reader_per_node) {
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &group);
+  } else {
+    MPI_Comm_dup(MPI_COMM_WORLD, &group);
+  }
+  int group_rank, group_size;
+  MPI_Comm_rank(group, &group_rank);
+  MPI_Comm_size(group, &group_size);
+  std::vector<int> members(group_size);
+  MPI_Allgather(&rank, 1, MPI_INT, members.data(), 1, MPI_INT, group);
+
+  LOG << "Inserting: local_n = " << local_n << " local_offset = " << local_offset
+      << " from reader rank " << members[0] << std::endl;
   auto start = std::chrono::high_resolution_clock::now();
+  InsertTimes times;
+  uint64_t local_nnz = 0;
+  uint64_t num_batches = (local_n + batch_size - 1) / batch_size;
+
+  if (group_rank == 0) {
+    std::ifstream file(datafile);
+    // Lines of the file consumed so far. The own rows come first in the group, and reading no
+    // rows skips nothing.
+    uint64_t line = local_n > 0 ? offset + local_offset + local_n : 0;
+    auto own = SvmDataset<Label_t>::ReadSvmDataset(file, datafile, (Label_t)local_offset, local_n,
+                                                   avg_dim, offset + local_offset);
+    local_nnz = own.markers[local_n];
+    uint64_t own_batch = 0;
+    auto insert_own = [&] {
+      uint64_t cnt = batch_rows(rank, own_batch);
+      InsertBatch(own.View(), own_batch++ * batch_size, cnt, nullptr, own.start, times);
+    };
+
+    std::unique_ptr<SvmDataset<Label_t>> slots[2];
+    MPI_Request requests[2][3];
+    uint64_t slot = 0, sent_rows = 0, sent_nnz = 0;
+    for (int m = 1; m < group_size; m++) {
+      int dest = members[m];
+      for (uint64_t b = 0; b * batch_size < bounds[dest + 1] - bounds[dest]; b++) {
+        if (slots[slot]) {
+          MPI_Waitall(3, requests[slot], MPI_STATUSES_IGNORE);
+        }
+        uint64_t first = offset + bounds[dest] + b * batch_size, n = batch_rows(dest, b);
+        slots[slot].reset(new SvmDataset<Label_t>(SvmDataset<Label_t>::ReadSvmDataset(
+            file, datafile, (Label_t)(first - offset), n, avg_dim, first - line)));
+        line = first + n;
+
+        const SvmDataset<Label_t>& batch = *slots[slot];
+        uint64_t nnz = batch.markers[n];
+        MPI_Isend(batch.markers, n + 1, MPI_UINT64_T, m, ScatterMarkersTag, group,
+                  &requests[slot][0]);
+        MPI_Isend(batch.indices, nnz, MPI_UINT32_T, m, ScatterIndicesTag, group,
+                  &requests[slot][1]);
+        MPI_Isend(batch.values, nnz, MPI_FLOAT, m, ScatterValuesTag, group, &requests[slot][2]);
+        sent_rows += n;
+        sent_nnz += nnz;
+        slot ^= 1;
+
+        if (own_batch < num_batches) {
+          insert_own();
+        }
+      }
+    }
+    for (uint64_t s = 0; s < 2; s++) {
+      if (slots[s]) {
+        MPI_Waitall(3, requests[s], MPI_STATUSES_IGNORE);
+      }
+    }
+    while (own_batch < num_batches) {
+      insert_own();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double megabytes = sent_nnz * (sizeof(uint32_t) + sizeof(float)) / (double)(1 << 20);
+    LOG << "Scattered " << sent_rows << " rows to " << group_size - 1 << " ranks in " << seconds
+        << " seconds, " << megabytes / seconds << " MB/s of nonzeros" << std::endl;
+  } else {
+    ScatterBatch batches[2];
+    if (num_batches > 0) {
+      batches[0].PostMarkers(batch_rows(rank, 0), group);
+    }
+    for (uint64_t b = 0; b < num_batches; b++) {
+      // Receives with the same tag match in the order they are posted, so the nonzeros of this
+      // batch must be posted before those of the next.
+      batches[b % 2].PostData(group, true);
+      ScatterBatch& next = batches[(b + 1) % 2];
+      if (b + 1 < num_batches) {
+        next.PostMarkers(batch_rows(rank, b + 1), group);
+        next.PostData(group, false);
+      }
+      CsrView view = batches[b % 2].Wait(group);
+      local_nnz += view.markers[view.len];
+      InsertBatch(view, 0, view.len, nullptr, (Label_t)(local_offset + b * batch_size), times);
+      if (b + 1 < num_batches) {
+        next.PostData(group, false);
+      }
+    }
+  }
+  MPI_Comm_free(&group);
+
+  LOG << "Inserted " << local_n << " vectors in " << num_batches << " batches in "
+      << std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::high_resolution_clock::now() - start)
+             .count()
+      << " seconds" << std::endl;
+  LogPartition(bounds, local_nnz, times, partition);
+}
+
+/*
+ * Splits the rows into parts contiguous ranges, moving each boundary to the row whose midpoint
+ * is closest to an equal share of the total nonzeros.
+ */
+static std::vector<uint64_t> BalanceNnz(const std::vector<uint64_t>& nnz, uint64_t parts) {
+  uint64_t total = std::accumulate(nnz.begin(), nnz.end(), (uint64_t)0);
+  std::vector<uint64_t> bounds(parts + 1, nnz.size());
+  bounds[0] = 0;
+
+  uint64_t row = 0, seen = 0;
+  for (uint64_t p = 1; p < parts; p++) {
+    uint64_t target = total * p / parts;
+    while (row < nnz.size() && seen + nnz[row] / 2 < target) {
+      seen += nnz[row++];
+    }
+    bounds[p] = row;
+  }
+  return bounds;
+}
+
+template <typename Label_t>
+std::vector<uint64_t> Slash<Label_t>::PartitionRows(std::string datafile, uint64_t N,
+                                                    uint64_t offset, Partition partition) {
+  std::vector<uint64_t> bounds(world_size + 1);
+  if (partition == Partition::Rows) {
+    for (int r = 0; r <= world_size; r++) {
+      bounds[r] = N / world_size * r + std::min<uint64_t>(r, N % world_size);
+    }
+    return bounds;
+  }
+
+  if (rank == 0) {
+    auto start = std::chrono::high_resolution_clock::now();
+    auto nnz = ReadSvmRowLengths(datafile, N, offset);
+    bounds = BalanceNnz(nnz, world_size);
+    auto end = std::chrono::high_resolution_clock::now();
+    LOG << "Scanned " << N << " rows for nnz partitioning in "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+        << " milliseconds" << std::endl;
+  }
+  MPI_Bcast(bounds.data(), world_size + 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+  return bounds;
+}
+
+template <typename Label_t>
+void Slash<Label_t>::LogPartition(const std::vector<uint64_t>& bounds, uint64_t local_nnz,
+                                  InsertTimes times, Partition partition) {
+  std::vector<uint64_t> nnz(world_size);
+  std::vector<double> hash(world_size), insert(world_size);
+  MPI_Gather(&local_nnz, 1, MPI_UINT64_T, nnz.data(), 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+  MPI_Gather(&times.hash, 1, MPI_DOUBLE, hash.data(), 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  MPI_Gather(&times.insert, 1, MPI_DOUBLE, insert.data(), 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  if (rank != 0) {
+    return;
+  }
+
+  LOG << "Partition by " << (partition == Partition::Nnz ? "nnz" : "rows") << ":" << std::endl;
+  for (int r = 0; r < world_size; r++) {
+    LOG << "  rank " << r << " rows [" << bounds[r] << ", " << bounds[r + 1] << ") nnz " << nnz[r]
+        << " hash " << hash[r] << " s insert " << insert[r] << " s" << std::endl;
+  }
+  // Imbalance is the slowest (or largest) rank over the mean, 1 when perfectly balanced.
+  auto imbalance = [](const auto& v) {
+    double mean = std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+    return mean > 0 ? *std::max_element(v.begin(), v.end()) / mean : 1.0;
+  };
+  LOG << "Imbalance (max / mean): nnz " << imbalance(nnz) << " hash " << imbalance(hash)
+      << " insert " << imbalance(insert) << std::endl;
+}
+
+template <typename Label_t>
+void Slash<Label_t>::InsertSVM(const SvmDataset<Label_t>& dataset, uint64_t batch_size) {
+  if (dataset.IsSequentiallyLabeled()) {
+    InsertBatches(dataset.View(), nullptr, dataset.start, batch_size);
+  } else {
+    InsertBatches(dataset.View(), dataset.labels, 0, batch_size);
+  }
+}
+
+template <typename Label_t>
+void Slash<Label_t>::InsertSVM(const CsrView& data, const Label_t* labels, uint64_t batch_size) {
+  InsertBatches(data, labels, 0, batch_size);
+}
+
+template <typename Label_t>
+void Slash<Label_t>::InsertSVM(const CsrView& data, Label_t start, uint64_t batch_size) {
+  InsertBatches(data, nullptr, start, batch_size);
+}
+
+template <typename Label_t>
+typename Slash<Label_t>::InsertTimes Slash<Label_t>::InsertBatches(const CsrView& data,
+                                                                   const Label_t* labels,
+                                                                   Label_t start_label,
+                                                                   uint64_t batch_size) {
+  using Clock = std::chrono::high_resolution_clock;
+  InsertTimes times;
+  uint64_t num_batches = (data.len + batch_size - 1) / batch_size;
+  auto start = Clock::now();
   for (uint64_t batch = 0; batch < num_batches; batch++) {
     uint64_t start = batch * batch_size;
-    uint64_t cnt = std::min(local_n, (batch + 1) * batch_size) - start;
-    auto hashes = hasher->Hash(dataset, start, cnt);
-    hash_tables->Insert(cnt, dataset.start + start, hashes);
+    uint64_t cnt = std::min(data.len, (batch + 1) * batch_size) - start;
+    InsertBatch(data, start, cnt, labels, start_label, times);
   }
-  auto end = std::chrono::high_resolution_clock::now();
+  auto end = Clock::now();
 
-  LOG << "Inserted " << local_n << " vectors in " << num_batches << " batches in "
+  LOG << "Inserted " << data.len << " vectors in " << num_batches << " batches in "
       << std::chrono::duration_cast<std::chrono::seconds>(end - start).count() << " seconds"
       << std::endl;
+  return times;
+}
+
+template <typename Label_t>
+void Slash<Label_t>::InsertBatch(const CsrView& data, uint64_t offset, uint64_t cnt,
+                                 const Label_t* labels, Label_t start_label, InsertTimes& times) {
+  using Clock = std::chrono::high_resolution_clock;
+  auto hash_start = Clock::now();
+  auto hashes = HashBatch(data, offset, cnt);
+  auto hash_end = Clock::now();
+  std::lock_guard<std::mutex> guard(ingest_lock);
+  auto insert_start = Clock::now();
+  if (labels == nullptr) {
+    hash_tables->Insert(cnt, start_label + offset, hashes);
+  } else {
+    hash_tables->Insert(cnt, labels + offset, hashes);
+  }
+  if (retain_signatures) {
+    signatures.insert(signatures.end(), hashes, hashes + cnt * hasher->NumTables());
+    for (uint64_t i = offset; i < offset + cnt; i++) {
+      signature_labels.push_back(labels == nullptr ? (Label_t)(start_label + i) : labels[i]);
+    }
+  }
+  InvalidateCache();
+  times.hash += std::chrono::duration<double>(hash_end - hash_start).count();
+  times.insert += std::chrono::duration<double>(Clock::now() - insert_start).count();
+}
+
+template <typename Label_t>
+void Slash<Label_t>::Delete(uint64_t n, const Label_t* labels) {
+  std::lock_guard<std::mutex> guard(ingest_lock);
+  hash_tables->Delete(n, labels);
+  InvalidateCache();
+}
+
+template <typename Label_t>
+void Slash<Label_t>::Update(const CsrView& data, const Label_t* labels) {
+  auto hashes = HashBatch(data, 0, data.len);
+  std::lock_guard<std::mutex> guard(ingest_lock);
+  hash_tables->Update(data.len, labels, hashes);
+  InvalidateCache();
+}
+
+template <typename Label_t>
+uint64_t Slash<Label_t>::Compact(double min_dead_fraction) {
+  std::lock_guard<std::mutex> guard(ingest_lock);
+  auto start = std::chrono::high_resolution_clock::now();
+  uint64_t reclaimed = hash_tables->Compact(min_dead_fraction);
+  auto end = std::chrono::high_resolution_clock::now();
+
+  if (reclaimed > 0) {
+    InvalidateCache();
+    LOG << "Compaction reclaimed " << reclaimed << " slots in "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+        << " milliseconds" << std::endl;
+  }
+  return reclaimed;
+}
+
+template <typename Label_t>
+void Slash<Label_t>::StartCompaction(uint64_t interval_ms, double min_dead_fraction) {
+  StopCompaction();
+  compactor_running = true;
+  compactor = std::thread([this, interval_ms, min_dead_fraction] {
+    std::unique_lock<std::mutex> lock(ingest_lock);
+    while (!compactor_cv.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                                  [this] { return !compactor_running; })) {
+      lock.unlock();
+      Compact(min_dead_fraction);
+      lock.lock();
+    }
+  });
+}
+
+template <typename Label_t>
+void Slash<Label_t>::StopCompaction() {
+  if (!compactor.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(ingest_lock);
+    compactor_running = false;
+  }
+  compactor_cv.notify_all();
+  compactor.join();
 }
 
-QueryResult<uint32_t> Slash::QuerySVMSingleMachine(std::string queryfile, uint64_t Q,
-                                                   uint64_t avg_dim, uint64_t topk) {
+template <typename Label_t>
+QueryResult<Label_t> Slash<Label_t>::QuerySVMSingleMachine(std::string queryfile, uint64_t Q,
+                                                           uint64_t avg_dim, uint64_t topk) {
   LOG << "Querying" << std::endl;
-  SvmDataset<uint32_t> queries =
-      SvmDataset<uint32_t>::ReadSvmDataset(queryfile, (uint32_t)0, Q, avg_dim, 0);
+  SvmDataset<Label_t> queries =
+      SvmDataset<Label_t>::ReadSvmDataset(queryfile, (Label_t)0, Q, avg_dim, 0);
 
+  QueryResult<Label_t> res;
   auto start = std::chrono::high_resolution_clock::now();
-  auto qHashes = hasher->Hash(queries, 0, Q);
-  auto res = hash_tables->Query(queries.len, qHashes, topk);
+  QuerySVMSingleMachine(queries.View(), topk, res);
   auto end = std::chrono::high_resolution_clock::now();
 
   LOG << "Performed " << Q << " queries in "
@@ -60,6 +500,135 @@ QueryResult<uint32_t> Slash::QuerySVMSingleMachine(std::string queryfile, uint64
   return res;
 }
 
+template <typename Label_t>
+void Slash<Label_t>::QuerySVMSingleMachine(const CsrView& queries, uint64_t topk,
+                                           QueryResult<Label_t>& result,
+                                           const LabelBitmap* filter) {
+  auto qHashes = HashBatch(queries, 0, queries.len, query_probes);
+  if (query_cache != nullptr && filter == nullptr) {
+    QueryCached(queries.len, qHashes, topk, result);
+  } else {
+    hash_tables->Query(queries.len, qHashes, topk, result, query_probes, filter);
+  }
+}
+
+template <typename Label_t>
+void Slash<Label_t>::SetAttributes(uint64_t n, const Label_t* labels, const uint32_t* values) {
+  std::lock_guard<std::mutex> guard(ingest_lock);
+  // The last value given for a label in this call wins.
+  std::vector<std::pair<Label_t, uint32_t>> given(n);
+  for (uint64_t i = 0; i < n; i++) {
+    given[i] = {labels[i], values[i]};
+  }
+  std::stable_sort(given.begin(), given.end(),
+                   [](const auto& a, const auto& b) { return a.first < b.first; });
+  std::vector<Label_t> replaced;
+  std::vector<std::pair<uint32_t, Label_t>> added;
+  for (uint64_t i = 0; i < n; i++) {
+    if (i + 1 < n && given[i + 1].first == given[i].first) {
+      continue;
+    }
+    replaced.push_back(given[i].first);
+    added.emplace_back(given[i].second, given[i].first);
+  }
+
+  attributes.erase(std::remove_if(attributes.begin(), attributes.end(),
+                                  [&](const auto& entry) {
+                                    return std::binary_search(replaced.begin(), replaced.end(),
+                                                              entry.second);
+                                  }),
+                   attributes.end());
+  std::sort(added.begin(), added.end());
+  uint64_t kept = attributes.size();
+  attributes.insert(attributes.end(), added.begin(), added.end());
+  std::inplace_merge(attributes.begin(), attributes.begin() + kept, attributes.end());
+}
+
+template <typename Label_t>
+uint64_t Slash<Label_t>::FilterByAttribute(uint32_t lo, uint32_t hi, LabelBitmap& filter) const {
+  if (lo > hi) {
+    return 0;
+  }
+  auto begin = std::lower_bound(attributes.begin(), attributes.end(),
+                                std::make_pair(lo, std::numeric_limits<Label_t>::min()));
+  auto end = std::upper_bound(begin, attributes.end(),
+                              std::make_pair(hi, std::numeric_limits<Label_t>::max()));
+  uint64_t matched = 0;
+  for (auto entry = begin; entry != end; entry++) {
+    matched += filter.Set(entry->second);
+  }
+  return matched;
+}
+
+template <typename Label_t>
+void Slash<Label_t>::EnableSplitting(uint64_t split_bits, double hot_factor) {
+  if (split_bits > hasher->SplitBits()) {
+    throw std::invalid_argument("split_bits = " + std::to_string(split_bits) +
+                                " but the hash family provides " +
+                                std::to_string(hasher->SplitBits()) + " secondary bits");
+  }
+  hash_tables->EnableSplitting(split_bits, hot_factor);
+  hasher->SetSplitBits(split_bits);
+}
+
+template <typename Label_t>
+uint64_t Slash<Label_t>::ScanSize(const CsrView& queries) {
+  auto qHashes = HashBatch(queries, 0, queries.len, query_probes);
+  return hash_tables->ScanSize(queries.len, qHashes, query_probes);
+}
+
+template <typename Label_t>
+void Slash<Label_t>::EnableQueryCache(uint64_t entries) {
+  delete query_cache;
+  query_cache = new QueryCache<Label_t>(entries);
+}
+
+template <typename Label_t>
+void Slash<Label_t>::QueryCached(uint64_t n, const uint32_t* hashes, uint64_t topk,
+                                 QueryResult<Label_t>& result) {
+  uint64_t signature_len = hasher->NumTables() * query_probes;
+  uint64_t epoch = query_cache->Epoch();
+  result.Reset(n, topk);
+
+  cache_misses.resize(n);
+  uint64_t* misses = cache_misses.data();
+  uint64_t num_misses = 0;
+  for (uint64_t q = 0; q < n; q++) {
+    if (!query_cache->Lookup(hashes + q * signature_len, signature_len, topk, result[q],
+                             result.len(q))) {
+      misses[num_misses++] = q;
+    }
+  }
+  if (num_misses == 0) {
+    return;
+  }
+
+  cache_miss_hashes.resize(num_misses * signature_len);
+  uint32_t* miss_hashes = cache_miss_hashes.data();
+  for (uint64_t i = 0; i < num_misses; i++) {
+    std::copy(hashes + misses[i] * signature_len, hashes + (misses[i] + 1) * signature_len,
+              miss_hashes + i * signature_len);
+  }
+  hash_tables->Query(num_misses, miss_hashes, topk, cache_miss_results, query_probes);
+
+  for (uint64_t i = 0; i < num_misses; i++) {
+    uint64_t q = misses[i];
+    result.len(q) = cache_miss_results.len(i);
+    std::copy(cache_miss_results[i], cache_miss_results[i] + cache_miss_results.len(i), result[q]);
+    query_cache->Store(miss_hashes + i * signature_len, signature_len, topk, epoch,
+                       cache_miss_results[i], cache_miss_results.len(i));
+  }
+}
+
+template <typename Label_t>
+void Slash<Label_t>::QueryAnytime(const CsrView& queries, uint64_t topk, uint64_t table_budget,
+                                  std::chrono::steady_clock::time_point deadline,
+                                  QueryResult<Label_t>& result, uint64_t* tables_used) {
+  auto qHashes = HashBatch(queries, 0, queries.len, query_probes);
+  hash_tables->QueryAnytime(queries.len, qHashes, topk, table_budget, deadline, result,
+                            tables_used, query_probes);
+}
+
 constexpr uint64_t BufLocID(uint64_t query, uint64_t index, uint64_t K) {
   return query * K * 2 + index * 2;
 }
@@ -68,91 +637,335 @@ constexpr uint64_t BufLocCnt(uint64_t query, uint64_t index, uint64_t K) {
   return query * K * 2 + index * 2 + 1;
 }
 
-QueryResult<uint32_t> Slash::QuerySVM(std::string queryfile, uint64_t Q, uint64_t avg_dim,
-                                      uint64_t topk) {
+template <typename Label_t>
+QueryResult<Label_t> Slash<Label_t>::QuerySVM(std::string queryfile, uint64_t Q,
+                                              uint64_t avg_dim, uint64_t topk) {
   LOG << "Querying" << std::endl;
-  SvmDataset<uint32_t> queries =
-      SvmDataset<uint32_t>::ReadSvmDataset(queryfile, (uint32_t)0, Q, avg_dim, 0);
+  SvmDataset<Label_t> queries =
+      SvmDataset<Label_t>::ReadSvmDataset(queryfile, (Label_t)0, Q, avg_dim, 0);
+
+  QueryResult<Label_t> result;
+  QuerySVM(queries.View(), topk, result);
+  return result;
+}
+
+template <typename Label_t>
+void Slash<Label_t>::QuerySVM(const CsrView& queries, uint64_t topk,
+                              QueryResult<Label_t>& result, const LabelBitmap* filter) {
+  uint64_t Q = queries.len;
+  ReduceTopK(queries, topk, filter);
 
+  result.Reset(Q, topk);
+
+  if (rank == 0) {
+    for (uint64_t q = 0; q < Q; q++) {
+      uint64_t loc = 0;
+      Label_t id = send_buf[BufLocID(q, loc, topk)];
+      while (id != std::numeric_limits<Label_t>::max()) {
+        result[q][loc++] = id;
+        if (loc >= topk) {
+          break;
+        }
+        id = send_buf[BufLocID(q, loc, topk)];
+      }
+      result.len(q) = loc;
+    }
+  }
+}
+
+template <typename Label_t>
+void Slash<Label_t>::QuerySVMStream(std::string queryfile, uint64_t Q, uint64_t avg_dim,
+                                    uint64_t topk, uint64_t chunk_size, std::string resultfile) {
+  LOG << "Querying in chunks of " << chunk_size << std::endl;
   auto start = std::chrono::high_resolution_clock::now();
-  auto qHashes = hasher->Hash(queries, 0, Q);
-  auto res = hash_tables->QueryWithCounts(queries.len, qHashes, topk);
+
+  std::ifstream file(queryfile);
+  std::unique_ptr<QueryResultWriter<Label_t>> writer;
+  if (rank == 0) {
+    writer.reset(new QueryResultWriter<Label_t>(resultfile, topk));
+  }
+
+  for (uint64_t done = 0; done < Q; done += chunk_size) {
+    uint64_t n = std::min(chunk_size, Q - done);
+    auto chunk = SvmDataset<Label_t>::ReadSvmDataset(file, queryfile, (Label_t)done, n, avg_dim);
+    ReduceTopK(chunk.View(), topk);
+    if (rank != 0) {
+      continue;
+    }
+
+    // Reuses count_buf, whose local results are no longer needed once reduced.
+    count_buf.Reset(n, topk);
+    for (uint64_t q = 0; q < n; q++) {
+      uint64_t loc = 0;
+      for (; loc < topk; loc++) {
+        Label_t id = send_buf[BufLocID(q, loc, topk)];
+        if (id == std::numeric_limits<Label_t>::max()) {
+          break;
+        }
+        count_buf[q][loc] = {id, (uint32_t)send_buf[BufLocCnt(q, loc, topk)]};
+      }
+      count_buf.len(q) = loc;
+    }
+    writer->Append(count_buf);
+  }
+  if (writer) {
+    writer->Close();
+  }
+
+  auto end = std::chrono::high_resolution_clock::now();
+  LOG << "Streamed " << Q << " queries to " << resultfile << " in "
+      << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+      << " milliseconds" << std::endl;
+}
+
+template <typename Label_t>
+void Slash<Label_t>::ReduceTopK(const CsrView& queries, uint64_t topk,
+                                const LabelBitmap* filter) {
+  uint64_t Q = queries.len;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  auto qHashes = HashBatch(queries, 0, Q, query_probes);
+  hash_tables->QueryWithCounts(Q, qHashes, topk, count_buf, query_probes, filter);
   auto end = std::chrono::high_resolution_clock::now();
 
   LOG << "Performed " << Q << " queries in "
       << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
       << " milliseconds" << std::endl;
 
-  uint32_t* send_buf = new uint32_t[Q * topk * 2];
+  auto& res = count_buf;
+  send_buf.resize(Q * topk * 2);
 
-  for (uint32_t q = 0; q < res.len(); q++) {
-    uint32_t i = 0;
+  // Padding sorts below every real entry: its count of 0 loses to any label found by a table.
+  for (uint64_t q = 0; q < res.len(); q++) {
+    uint64_t i = 0;
     for (; i < res.len(q); i++) {
       send_buf[BufLocID(q, i, topk)] = res[q][i].first;
       send_buf[BufLocCnt(q, i, topk)] = res[q][i].second;
     }
     for (; i < topk; i++) {
-      send_buf[BufLocID(q, i, topk)] = std::numeric_limits<uint32_t>::max();
-      send_buf[BufLocCnt(q, i, topk)] = std::numeric_limits<uint32_t>::max();
+      send_buf[BufLocID(q, i, topk)] = std::numeric_limits<Label_t>::max();
+      send_buf[BufLocCnt(q, i, topk)] = 0;
     }
   }
 
   uint32_t num_iter = std::ceil(std::log(world_size) / std::log(2));
-  uint32_t* recv_buf = new uint32_t[Q * topk * 2];
+  recv_buf.resize(Q * topk * 2);
+  merge_buf.resize(Q * topk * 2);
   MPI_Status status;
   for (uint32_t iter = 0; iter < num_iter; iter++) {
     if (rank % ((int)std::pow(2, iter + 1)) == 0 && (rank + std::pow(2, iter)) < world_size) {
       int source = rank + std::pow(2, iter);
       LOG << "Iter: " << iter << " Receiving from: " << source << std::endl;
-      MPI_Recv(recv_buf, Q * topk * 2, MPI_UNSIGNED, source, iter, MPI_COMM_WORLD, &status);
-
-      uint32_t* new_send_buf = new uint32_t[Q * topk * 2];
+      MPI_Recv(recv_buf.data(), Q * topk * 2, MpiType<Label_t>(), source, iter, MPI_COMM_WORLD,
+               &status);
 
       for (uint64_t q = 0; q < Q; q++) {
-        uint32_t loc = 0, loc_self = 0, loc_recv = 0;
+        uint64_t loc = 0, loc_self = 0, loc_recv = 0;
         while (loc < topk) {
           if (recv_buf[BufLocCnt(q, loc_recv, topk)] > send_buf[BufLocCnt(q, loc_self, topk)]) {
-            new_send_buf[BufLocID(q, loc, topk)] = recv_buf[BufLocID(q, loc_recv, topk)];
-            new_send_buf[BufLocCnt(q, loc, topk)] = recv_buf[BufLocCnt(q, loc_recv, topk)];
+            merge_buf[BufLocID(q, loc, topk)] = recv_buf[BufLocID(q, loc_recv, topk)];
+            merge_buf[BufLocCnt(q, loc, topk)] = recv_buf[BufLocCnt(q, loc_recv, topk)];
             loc++;
             loc_recv++;
           } else {
-            new_send_buf[BufLocID(q, loc, topk)] = send_buf[BufLocID(q, loc_self, topk)];
-            new_send_buf[BufLocCnt(q, loc, topk)] = send_buf[BufLocCnt(q, loc_self, topk)];
+            merge_buf[BufLocID(q, loc, topk)] = send_buf[BufLocID(q, loc_self, topk)];
+            merge_buf[BufLocCnt(q, loc, topk)] = send_buf[BufLocCnt(q, loc_self, topk)];
             loc++;
             loc_self++;
           }
         }
       }
-      delete[] send_buf;
-
-      send_buf = new_send_buf;
+      send_buf.swap(merge_buf);
 
     } else if (rank % ((int)std::pow(2, iter + 1)) == ((int)std::pow(2, iter))) {
       int destination = rank - ((int)std::pow(2, iter));
       LOG << "Iter: " << iter << " Sending to: " << destination << std::endl;
-      MPI_Send(send_buf, Q * topk * 2, MPI_UNSIGNED, destination, iter, MPI_COMM_WORLD);
+      MPI_Send(send_buf.data(), Q * topk * 2, MpiType<Label_t>(), destination, iter,
+               MPI_COMM_WORLD);
     }
   }
+}
+template <typename Label_t>
+void Slash<Label_t>::BuildKnnGraph(uint64_t k, uint64_t batch_size, std::string graphfile) {
+  using Clock = std::chrono::high_resolution_clock;
+  constexpr Label_t Padding = std::numeric_limits<Label_t>::max();
+  // Entries are (label, count, owner rank) triples, widened to Label_t so that one MPI datatype
+  // fits, and sorted by decreasing count.
+  constexpr uint64_t EntryLen = 3;
+  uint64_t L = hasher->NumTables();
+  uint64_t width = k + 1;
+  auto start = Clock::now();
 
-  delete[] recv_buf;
+  // The visiting block starts out as this rank's rows, and is home again after world_size steps.
+  std::vector<uint32_t> block_sigs, recv_sigs;
+  std::vector<Label_t> block_labels = signature_labels, recv_labels;
+  std::vector<Label_t> block_best(block_labels.size() * width * EntryLen, 0), recv_best;
+  block_sigs.swap(signatures);
+  for (uint64_t e = 0; e < block_labels.size() * width; e++) {
+    block_best[e * EntryLen] = Padding;
+  }
 
-  QueryResult<uint32_t> result(Q, topk);
+  int next = (rank + 1) % world_size, prev = (rank + world_size - 1) % world_size;
+  for (int step = 0; step < world_size; step++) {
+    uint64_t n = block_labels.size();
+    for (uint64_t b = 0; b < n; b += batch_size) {
+      uint64_t cnt = std::min(batch_size, n - b);
+      hash_tables->QueryWithCounts(cnt, block_sigs.data() + b * L, width, count_buf, 1);
 
-  if (rank == 0) {
-    for (uint32_t q = 0; q < Q; q++) {
-      uint32_t loc = 0;
-      uint32_t id = send_buf[BufLocID(q, loc, topk)];
-      while (id != std::numeric_limits<uint32_t>::max()) {
-        result[q][loc++] = id;
-        if (loc >= topk) {
-          break;
+      // Labels are disjoint across ranks, so the new entries are inserted without a duplicate
+      // check, and entries from earlier ranks win ties.
+      for (uint64_t q = 0; q < cnt; q++) {
+        Label_t* best = block_best.data() + (b + q) * width * EntryLen;
+        for (uint64_t i = 0; i < count_buf.len(q); i++) {
+          Label_t count = count_buf[q][i].second;
+          uint64_t pos = width;
+          while (pos > 0 && best[(pos - 1) * EntryLen + 1] < count) {
+            pos--;
+          }
+          if (pos == width) {
+            break;
+          }
+          std::copy_backward(best + pos * EntryLen, best + (width - 1) * EntryLen,
+                             best + width * EntryLen);
+          best[pos * EntryLen] = count_buf[q][i].first;
+          best[pos * EntryLen + 1] = count;
+          best[pos * EntryLen + 2] = rank;
         }
-        id = send_buf[BufLocID(q, loc, topk)];
       }
-      result.len(q) = loc;
     }
+
+    if (world_size == 1) {
+      break;
+    }
+    uint64_t recv_n;
+    MPI_Sendrecv(&n, 1, MPI_UINT64_T, next, 0, &recv_n, 1, MPI_UINT64_T, prev, 0, MPI_COMM_WORLD,
+                 MPI_STATUS_IGNORE);
+    recv_sigs.resize(recv_n * L);
+    recv_labels.resize(recv_n);
+    recv_best.resize(recv_n * width * EntryLen);
+    SendrecvChunked(block_sigs.data(), n * L, next, recv_sigs.data(), recv_n * L, prev, 1);
+    SendrecvChunked(block_labels.data(), n, next, recv_labels.data(), recv_n, prev, 2);
+    SendrecvChunked(block_best.data(), n * width * EntryLen, next, recv_best.data(),
+                    recv_n * width * EntryLen, prev, 3);
+    block_sigs.swap(recv_sigs);
+    block_labels.swap(recv_labels);
+    block_best.swap(recv_best);
   }
+  signatures.swap(block_sigs);
+  auto join_end = Clock::now();
 
-  return result;
-}
\ No newline at end of file
+  // Keeps the best k entries other than the row itself, and sends each edge reversed, as
+  // (target, source, count) triples, to the owner of its target.
+  uint64_t n = signature_labels.size();
+  std::vector<std::vector<std::pair<Label_t, uint32_t>>> adjacency(n);
+  std::vector<std::vector<Label_t>> reverse(world_size);
+  for (uint64_t q = 0; q < n; q++) {
+    const Label_t* best = block_best.data() + q * width * EntryLen;
+    for (uint64_t i = 0; i < width && adjacency[q].size() < k; i++) {
+      Label_t label = best[i * EntryLen], count = best[i * EntryLen + 1];
+      if (label == Padding) {
+        break;
+      }
+      if (label == signature_labels[q]) {
+        continue;
+      }
+      adjacency[q].emplace_back(label, (uint32_t)count);
+      reverse[best[i * EntryLen + 2]].insert(reverse[best[i * EntryLen + 2]].end(),
+                                             {label, signature_labels[q], count});
+    }
+  }
+
+  // MPI_Alltoallv takes int counts and displacements, so the edges of each rank must fit in one.
+  std::vector<int> send_counts(world_size), send_displs(world_size), recv_counts(world_size),
+      recv_displs(world_size);
+  std::vector<Label_t> send_edges, recv_edges;
+  for (int r = 0; r < world_size; r++) {
+    send_displs[r] = send_edges.size();
+    send_counts[r] = reverse[r].size();
+    send_edges.insert(send_edges.end(), reverse[r].begin(), reverse[r].end());
+  }
+  uint64_t max_edges = send_edges.size();
+  MPI_Allreduce(MPI_IN_PLACE, &max_edges, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+  if (max_edges > (uint64_t)std::numeric_limits<int>::max()) {
+    throw std::runtime_error("A rank has " + std::to_string(max_edges / EntryLen) +
+                             " reverse kNN edges, more than one MPI_Alltoallv can carry");
+  }
+  MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+  for (int r = 1; r < world_size; r++) {
+    recv_displs[r] = recv_displs[r - 1] + recv_counts[r - 1];
+  }
+  recv_edges.resize(recv_displs.back() + recv_counts.back());
+  MPI_Alltoallv(send_edges.data(), send_counts.data(), send_displs.data(), MpiType<Label_t>(),
+                recv_edges.data(), recv_counts.data(), recv_displs.data(), MpiType<Label_t>(),
+                MPI_COMM_WORLD);
+
+  std::unordered_map<Label_t, uint64_t> row_of;
+  for (uint64_t q = 0; q < n; q++) {
+    row_of[signature_labels[q]] = q;
+  }
+  for (uint64_t e = 0; e < recv_edges.size(); e += EntryLen) {
+    auto it = row_of.find(recv_edges[e]);
+    if (it != row_of.end()) {
+      adjacency[it->second].emplace_back(recv_edges[e + 1], (uint32_t)recv_edges[e + 2]);
+    }
+  }
+
+  // An edge found from both ends is kept once, with the higher count.
+  std::vector<uint64_t> offsets(n + 1, 0);
+  std::vector<Label_t> neighbours;
+  std::vector<uint32_t> counts;
+  for (uint64_t q = 0; q < n; q++) {
+    auto& edges = adjacency[q];
+    std::sort(edges.begin(), edges.end(), [](const auto& a, const auto& b) {
+      return a.first < b.first || (a.first == b.first && a.second > b.second);
+    });
+    edges.erase(std::unique(edges.begin(), edges.end(),
+                            [](const auto& a, const auto& b) { return a.first == b.first; }),
+                edges.end());
+    std::sort(edges.begin(), edges.end(), [](const auto& a, const auto& b) {
+      return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    for (const auto& edge : edges) {
+      neighbours.push_back(edge.first);
+      counts.push_back(edge.second);
+    }
+    offsets[q + 1] = neighbours.size();
+    std::vector<std::pair<Label_t, uint32_t>>().swap(edges);
+  }
+
+  // Rank 0 writes its own rows and then those of every other rank in turn.
+  uint64_t sizes[2] = {n, neighbours.size()};
+  if (rank == 0) {
+    KnnGraphWriter<Label_t> writer(graphfile, k);
+    writer.Append(n, signature_labels.data(), offsets.data(), neighbours.data(), counts.data());
+    for (int source = 1; source < world_size; source++) {
+      MPI_Recv(sizes, 2, MPI_UINT64_T, source, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      recv_labels.resize(sizes[0]);
+      offsets.resize(sizes[0] + 1);
+      neighbours.resize(sizes[1]);
+      counts.resize(sizes[1]);
+      RecvChunked(recv_labels.data(), sizes[0], source, 1);
+      RecvChunked(offsets.data(), sizes[0] + 1, source, 2);
+      RecvChunked(neighbours.data(), sizes[1], source, 3);
+      RecvChunked(counts.data(), sizes[1], source, 4);
+      writer.Append(sizes[0], recv_labels.data(), offsets.data(), neighbours.data(),
+                    counts.data());
+    }
+    writer.Close();
+    sizes[0] = writer.NumRows();
+    sizes[1] = writer.NumEdges();
+  } else {
+    MPI_Send(sizes, 2, MPI_UINT64_T, 0, 0, MPI_COMM_WORLD);
+    SendChunked(signature_labels.data(), n, 0, 1);
+    SendChunked(offsets.data(), n + 1, 0, 2);
+    SendChunked(neighbours.data(), sizes[1], 0, 3);
+    SendChunked(counts.data(), sizes[1], 0, 4);
+  }
+
+  auto end = Clock::now();
+  LOG << "Built kNN graph of " << sizes[0] << " rows and " << sizes[1] << " edges in "
+      << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+      << " milliseconds, self join "
+      << std::chrono::duration_cast<std::chrono::milliseconds>(join_end - start).count()
+      << " milliseconds" << std::endl;
+}
@@ -1,28 +1,261 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Bitmap.h"
 #include "DOPH.h"
+#include "DataLoader.h"
 #include "HashTable.h"
+#include "Hasher.h"
+#include "QueryCache.h"
+
+// How InsertSVM from a file divides the rows among ranks.
+enum class Partition {
+  Rows,  // Equal numbers of rows.
+  Nnz,   // Contiguous rows with roughly equal numbers of nonzeros, from a pre-scan on rank 0.
+};
 
+/*
+ * Label_t is uint32_t for the compact index, or uint64_t once the labels across the cluster no
+ * longer fit in 32 bits, at the cost of twice the memory per bucket slot.
+ */
+template <typename Label_t>
 class Slash {
  public:
-  Slash(uint64_t K, uint64_t L, uint64_t range_pow, uint64_t reservoir_size);
+  /*
+   * With concurrent set the in memory InsertSVM and QuerySVMSingleMachine overloads may be
+   * called at the same time from different threads.
+   */
+  Slash(uint64_t K, uint64_t L, uint64_t range_pow, uint64_t reservoir_size,
+        bool concurrent = false);
+
+  /*
+   * Indexes with the given hash family instead of DOPH, taking ownership of the hasher. The
+   * number of tables and range of the index follow the hasher.
+   */
+  Slash(Hasher* hasher, uint64_t reservoir_size, bool concurrent = false);
 
+  /*
+   * Collective over all ranks. Each rank reads and inserts its own contiguous range of the N rows,
+   * after which rank 0 logs the partition with per rank hash and insert times. Here and in the
+   * other file overloads avg_dim is only a hint for the initial read buffer, 0 if unknown.
+   */
   void InsertSVM(std::string datafile, uint64_t N, uint64_t offset, uint64_t avg_dim,
-                 uint64_t batch_size);
+                 uint64_t batch_size, Partition partition = Partition::Rows);
+
+  /*
+   * Collective insert for ranks that cannot all open datafile, with the same partition and labels
+   * as InsertSVM. A single reader, rank 0, or with reader_per_node the lowest rank on each node,
+   * parses the file and sends every other rank in its group that rank's rows in batches of
+   * batch_size. Reading the next batch overlaps sending the last one, and receivers post the
+   * receive of their next batch before hashing and inserting the current one, so that only two
+   * batches are buffered per rank. The reader inserts its own rows while its sends are in
+   * flight. With Partition::Nnz rank 0 must also be able to read datafile.
+   */
+  void InsertSVMScatter(std::string datafile, uint64_t N, uint64_t offset, uint64_t avg_dim,
+                        uint64_t batch_size, Partition partition = Partition::Rows,
+                        bool reader_per_node = false);
+
+  void InsertSVM(const SvmDataset<Label_t>& dataset, uint64_t batch_size);
+
+  void InsertSVM(const CsrView& data, const Label_t* labels, uint64_t batch_size);
 
-  QueryResult<uint32_t> QuerySVMSingleMachine(std::string queryfile, uint64_t Q, uint64_t avg_dim,
+  void InsertSVM(const CsrView& data, Label_t start, uint64_t batch_size);
+
+  QueryResult<Label_t> QuerySVMSingleMachine(std::string queryfile, uint64_t Q, uint64_t avg_dim,
                                               uint64_t topk);
 
-  QueryResult<uint32_t> QuerySVM(std::string queryfile, uint64_t Q, uint64_t avg_dim,
+  /*
+   * With a filter only the labels set in it can be returned, see HashTable::Query. Filtered
+   * queries bypass the query cache. Queries through the cache reuse its miss buffers held by this
+   * object, so they must not be called concurrently with each other.
+   */
+  void QuerySVMSingleMachine(const CsrView& queries, uint64_t topk, QueryResult<Label_t>& result,
+                             const LabelBitmap* filter = nullptr);
+
+  /*
+   * Single machine query with a latency budget, see HashTable::QueryAnytime. The number of
+   * tables visited per query is written to tables_used.
+   */
+  void QueryAnytime(const CsrView& queries, uint64_t topk, uint64_t table_budget,
+                    std::chrono::steady_clock::time_point deadline, QueryResult<Label_t>& result,
+                    uint64_t* tables_used);
+
+  QueryResult<Label_t> QuerySVM(std::string queryfile, uint64_t Q, uint64_t avg_dim,
                                  uint64_t topk);
 
+  /*
+   * Distributed query over caller owned data. Reuses the result and reduction buffers held by
+   * this object, so it must not be called concurrently with itself. Each rank applies its own
+   * filter, typically built by FilterByAttribute, so that only matching labels are counted and
+   * reduced.
+   */
+  void QuerySVM(const CsrView& queries, uint64_t topk, QueryResult<Label_t>& result,
+                const LabelBitmap* filter = nullptr);
+
+  /*
+   * Collective distributed query that reads the query file in chunks of chunk_size and runs each
+   * through hashing, querying and the top k reduction before reading the next, so that memory is
+   * bounded by the chunk rather than by Q. Rank 0 appends the labels and counts of every finished
+   * chunk to resultfile, see QueryResultWriter.
+   */
+  void QuerySVMStream(std::string queryfile, uint64_t Q, uint64_t avg_dim, uint64_t topk,
+                      uint64_t chunk_size, std::string resultfile);
+
+  /*
+   * Keeps the bucket ids of every row inserted from now on, L per row, so that BuildKnnGraph can
+   * query with them instead of reading and hashing the data again. These are the ids at insertion,
+   * Delete and Update do not change them.
+   */
+  void RetainSignatures() { retain_signatures = true; }
+
+  uint64_t NumSignatures() const { return signature_labels.size(); }
+
+  /*
+   * Collective self join that writes the approximate k nearest neighbour graph of the rows kept by
+   * RetainSignatures to graphfile, see KnnGraphWriter. Each rank's block of signatures travels
+   * around a ring of ranks, and every rank queries its tables with the visiting block in batches
+   * of batch_size, merging the hits into the block's best k + 1 entries so far. Once a block is
+   * home each row drops itself and keeps k neighbours, and every edge is also sent to the owner
+   * of its other end, so that the graph is symmetric. Rank 0 writes the rows of all ranks,
+   * receiving the whole adjacency of one rank at a time, so it needs memory for the largest
+   * rank's rows and edges on top of its own.
+   */
+  void BuildKnnGraph(uint64_t k, uint64_t batch_size, std::string graphfile);
+
+  /*
+   * Stores an attribute, such as a tenant or a day, for each of n labels on this rank, replacing
+   * any earlier value of the same label. Attributes are kept as a column of (attribute, label)
+   * pairs sorted by attribute, so a call costs a pass over the column and is meant for ingest.
+   */
+  void SetAttributes(uint64_t n, const Label_t* labels, const uint32_t* values);
+
+  /*
+   * Sets in filter the labels on this rank whose attribute lies in [lo, hi], and returns how many
+   * there are. Costs a binary search plus one step per match. The filter must cover the largest
+   * label, see LabelBitmap.
+   */
+  uint64_t FilterByAttribute(uint32_t lo, uint32_t hi, LabelBitmap& filter) const;
+
+  // Number of buckets probed per table by queries, see DOPH::Hash.
+  void SetQueryProbes(uint64_t probes) { query_probes = probes; }
+
+  /*
+   * Splits buckets that receive more than hot_factor times reservoir_size labels into sub buckets
+   * selected by split_bits bits of secondary hash, see HashTable::EnableSplitting. Call before
+   * inserting. Throws std::invalid_argument if the hasher provides fewer bits.
+   */
+  void EnableSplitting(uint64_t split_bits, double hot_factor);
+
+  uint64_t NumSplitBuckets() const { return hash_tables->NumSplitBuckets(); }
+
+  // Number of bucket slots QuerySVMSingleMachine reads for queries, see HashTable::ScanSize.
+  uint64_t ScanSize(const CsrView& queries);
+
+  /*
+   * Caches the results of up to entries QuerySVMSingleMachine queries by their bucket ids, see
+   * QueryCache. Inserts, deletes, updates and compactions invalidate the cached results.
+   */
+  void EnableQueryCache(uint64_t entries);
+
+  // Null unless EnableQueryCache has been called.
+  const QueryCache<Label_t>* Cache() const { return query_cache; }
+
+  uint64_t IndexBytes() const {
+    return hash_tables->Bytes() + attributes.capacity() * sizeof(attributes[0]);
+  }
+
+  void Delete(uint64_t n, const Label_t* labels);
+
+  // Must be called on the rank that originally inserted the labels.
+  void Update(const CsrView& data, const Label_t* labels);
+
+  uint64_t Compact(double min_dead_fraction);
+
+  /*
+   * Runs Compact every interval_ms on a background thread. Compaction is serialized with
+   * inserts, deletes and updates, and queries wait while a compaction pass runs, see
+   * HashTable::Compact.
+   */
+  void StartCompaction(uint64_t interval_ms, double min_dead_fraction);
+
+  void StopCompaction();
+
   ~Slash() {
+    StopCompaction();
     delete hasher;
     delete hash_tables;
+    delete query_cache;
   }
 
  private:
+  struct InsertTimes {
+    double hash = 0, insert = 0;
+  };
+
+  /*
+   * Queries the local tables and reduces the top k across ranks, leaving interleaved (label,
+   * count) pairs for each query in send_buf on rank 0, padded with the maximum label.
+   */
+  void ReduceTopK(const CsrView& queries, uint64_t topk, const LabelBitmap* filter = nullptr);
+
+  InsertTimes InsertBatches(const CsrView& data, const Label_t* labels, Label_t start,
+                            uint64_t batch_size);
+
+  // Hashes and inserts rows [offset, offset + cnt) of data, adding to the times.
+  void InsertBatch(const CsrView& data, uint64_t offset, uint64_t cnt, const Label_t* labels,
+                   Label_t start, InsertTimes& times);
+
+  // Row boundaries of each rank's range, world_size + 1 entries.
+  std::vector<uint64_t> PartitionRows(std::string datafile, uint64_t N, uint64_t offset,
+                                      Partition partition);
+
+  void LogPartition(const std::vector<uint64_t>& bounds, uint64_t local_nnz, InsertTimes times,
+                    Partition partition);
+
+  const uint32_t* HashBatch(const CsrView& data, uint64_t offset, uint64_t num,
+                            uint64_t probes = 1);
+
+  // Answers the hits of a batch from the cache and queries the tables for the rest.
+  void QueryCached(uint64_t n, const uint32_t* hashes, uint64_t topk, QueryResult<Label_t>& result);
+
+  // Called with ingest_lock held after every change to the tables.
+  void InvalidateCache() {
+    if (query_cache != nullptr) {
+      query_cache->Invalidate();
+    }
+  }
+
   int rank, world_size;
-  DOPH<uint32_t, uint32_t>* hasher;
-  HashTable<uint32_t, uint32_t>* hash_tables;
-};
\ No newline at end of file
+  uint64_t query_probes = 1;
+  Hasher* hasher;
+  HashTable<Label_t, uint32_t>* hash_tables;
+  QueryCache<Label_t>* query_cache = nullptr;
+
+  // Interleaved (label, count) pairs, counts widened to Label_t so that one MPI datatype fits.
+  std::vector<Label_t> send_buf, recv_buf, merge_buf;
+  QueryResult<std::pair<Label_t, uint32_t>> count_buf;
+
+  // Positions, signatures and results of the queries that missed the cache, see QueryCached.
+  std::vector<uint64_t> cache_misses;
+  std::vector<uint32_t> cache_miss_hashes;
+  QueryResult<Label_t> cache_miss_results;
+
+  // Bucket ids and labels of the inserted rows, see RetainSignatures.
+  bool retain_signatures = false;
+  std::vector<uint32_t> signatures;
+  std::vector<Label_t> signature_labels;
+
+  // (attribute, label) pairs sorted by attribute and then label, see SetAttributes.
+  std::vector<std::pair<uint32_t, Label_t>> attributes;
+
+  std::mutex ingest_lock;
+  std::thread compactor;
+  std::condition_variable compactor_cv;
+  bool compactor_running = false;
+};